@@ -1,3 +1,5 @@
+// Compilar: gcc -O2 -pthread -o balanza5 balanza5.c -lm
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,11 +10,122 @@
 #include <time.h>
 #include <sys/select.h>
 #include <math.h>
+#include <limits.h>
 #include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "balanza_shm.h"
 
 #define SERIAL_PORT "/dev/ttyUSB0"
 //#define SERIAL_PORT "/dev/ttyACM0"
-#define BAUDRATE B9600
+#define BAUDRATE 9600
+#define MAX_SCALES 1024
+#define MIN_PERIOD_NS 10000LL   // 100 kHz como tope de frecuencia
+#define FRAME_MAX 64
+#define OUTQ_SLOTS 32           // tramas pendientes por puerto (potencia de 2)
+#define OUTQ_IOV (OUTQ_SLOTS * 3)  // iovec por escritura: con --fallas, hasta 3 por trama
+#define RNG_BLOCK 64            // incrementos generados por llamada a rng_fill_steps()
+#define TRACE_MAGIC "BALTRZ01"
+#define TRACE_VERSION 1
+#define TRACE_BUF_RECORDS 65536 // registros por buffer de grabación (1 MiB)
+#define NET_RING 32768          // historia por balanza para clientes TCP (potencia de 2)
+#define MAX_CLIENTS 16384
+#define MAX_CONTROL 32          // conexiones simultáneas al socket de control
+#define MAX_SHARDS 64
+#define CMD_SLOTS 256           // comandos pendientes por shard
+#define CONTROL_LINE 256
+#define CONTROL_OUT_MAX (1 << 20)  // respuestas sin leer por conexión de control
+#define MAX_METRICS_CONN 8      // conexiones simultáneas al endpoint de métricas
+#define METRICS_REQUEST 1024    // cabecera HTTP más larga que se acepta
+#define LOG_SLOTS 4096          // líneas de consola en vuelo (potencia de 2)
+#define LOG_LINE 160
+#define HIST_SUB_BITS 4         // 16 sub-buckets por potencia de 2 (~6% de resolución)
+#define HIST_BUCKETS ((36 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)   // hasta ~68 s en ns
+#define BENCH_FRAMES 20000000
+#define VALIDATE_LINE 256       // línea más larga que se acepta como trama
+#define COMPARE_WINDOW 65536    // tramas perdidas seguidas que se buscan al comparar
+#define TRACE_CORRUPT 1         // flags: trama recibida dañada (trazas de --validar)
+#define TRACE_FAULT 2           // flags: trama enviada con una falla inyectada (--fallas)
+#define FAULT_NOISE 256         // bytes de ruido de donde salen las fallas
+#define FAULT_NOISE_MAX 16      // ruido insertado antes de una trama, bytes
+#define FAULT_STALL_MAX_NS 200000000LL  // puerto detenido, a lo sumo
+#define BENCH_WARMUP_NS 500000000LL // arranque que no se mide en cada escenario
+#define BENCH_RUN_NS 2000000000LL   // ventana medida de cada escenario
+#define BENCH_START_NS 10000000000LL
+#define BENCH_JITTER_SCALES 16
+#define BENCH_BAUD "921600"         // línea rápida: el cable no limita 1 kHz
+#define STRESS_STEP_NS 2000000000LL // duración mínima de cada escalón de --estres
+#define STRESS_STEP_FRAMES 20       // y tramas mínimas, para las frecuencias bajas
+#define STRESS_WARMUP_NS 1000000000LL // a la frecuencia inicial, sin anotar: los lectores se conectan
+#define STRESS_FACTOR 1.25          // subida de frecuencia entre escalones
+#define STRESS_MAX_STEPS 96
+#define STRESS_MAX_BURST OUTQ_SLOTS
+
+// Etiquetas para epoll: tipo en los 32 bits altos, índice de balanza en los bajos
+#define EV_STDIN 1u
+#define EV_TIMER 2u
+#define EV_PORT  3u
+#define EV_LISTEN 4u
+#define EV_CLIENT 5u
+#define EV_SIGNAL 6u
+#define EV_CONTROL 7u
+#define EV_CTRL_CONN 8u
+#define EV_COMMAND 9u
+#define EV_WAKE 10u
+#define EV_URING 11u
+#define EV_METRICS 12u
+#define EV_METRICS_CONN 13u
+#define URING_MAX_ENTRIES 4096
+#define MAX_EVENTS 1024
+#define PHYS_MAX_DT_NS 10000000LL   // paso máximo del modelo físico: 10ms
+#define PHYS_MAX_STEPS 1000         // pasos por avance; un atraso mayor se salta
+#define PHYS_BENCH_STEPS 20000
+#define EV_TAG(kind, idx) (((uint64_t)(kind) << 32) | (uint32_t)(idx))
+#define EV_KIND(tag)      ((uint32_t)((tag) >> 32))
+#define EV_INDEX(tag)     ((uint32_t)(tag))
+
+// Estado que informa cada trama
+enum { STATUS_ST, STATUS_US, STATUS_OL };
+static const char status_code[][3] = { "ST", "US", "OL" };
+
+// Qué se muestra en consola
+enum { ECHO_ALL, ECHO_SAMPLED, ECHO_EVENTS, ECHO_NONE };
+enum { LOG_FRAME, LOG_EVENT, LOG_ALWAYS };
+
+// Fallas que --fallas inyecta en la salida serie
+enum { FAULT_NONE, FAULT_CORRUPT, FAULT_TRUNCATE, FAULT_NO_CRLF, FAULT_NOISE_BEFORE, FAULT_DUPLICATE,
+       FAULT_REORDER, FAULT_STALL, N_FAULTS };
+static const char *const fault_names[] = { "", "corromper", "truncar", "sin-fin", "ruido", "duplicar", "reordenar",
+                                           "detener" };
+
+// Control de flujo del puerto serie
+enum { FLOW_NONE, FLOW_RTSCTS, FLOW_XONXOFF };
+
+// Política cuando la cola de salida de un puerto se llena
+enum { OVERFLOW_DROP_OLDEST, OVERFLOW_DROP_NEWEST, OVERFLOW_STALL };
 
 typedef struct {
     // Rango de valores
@@ -23,9 +136,48 @@ typedef struct {
 
     // Control de incremento
     int update_interval;   // segundos
+    long long period_ns;   // periodo efectivo; 0 = usar update_interval
+    int catch_up;          // 1 = reenviar plazos perdidos, 0 = saltarlos
+    int overflow_policy;   // qué hacer con la cola de salida llena
+    int outq_limit;        // bytes máximos en la cola del tty antes de esperar
+
+    // Línea serie
+    int baud;
+    char parity;           // 'n', 'e' (par) u 'o' (impar)
+    int data_bits;         // 7 u 8
+    int stop_bits;         // 1 o 2
+    int flow;
+    int cap_to_line;       // 1 = limitar la frecuencia a la capacidad de la línea
+    int io_uring;          // 1 = escrituras por io_uring en vez de writev
+    int lookahead;         // tramas de la rampa codificadas por adelantado, 0 = no
+    double fault_p[N_FAULTS];     // probabilidad de cada falla por trama (--fallas), índice FAULT_*
+    int faults;            // alguna falla activa
+
+    // Red
+    int tcp_port;          // 0 = sin TCP; la balanza i escucha en tcp_port + i
+    int tcp_skip;          // cliente lento: 1 = saltar a la última trama, 0 = cortarlo
+    struct sockaddr_in udp_addr;  // grupo multicast; la balanza i usa puerto + i
+    int udp_enabled;
+    const char *shm_name;  // segmento de memoria compartida, NULL = no publicar
+    const char *control_path;  // socket Unix de control, NULL = sin socket
+    struct sockaddr_in metrics_addr;  // endpoint HTTP de métricas (Prometheus)
+    int metrics_enabled;
+
+    // Consola
+    int echo_mode;
+    int echo_every;        // con ECHO_SAMPLED, mostrar una de cada N tramas
     int step_value;        // paso entero
     int paused;
 
+    // Modelo físico (--modelo fisico)
+    double phys_freq;      // frecuencia natural del plato, Hz
+    double phys_damping;   // amortiguamiento relativo (1 = crítico)
+    double phys_noise;     // vibración, kg pico
+    double phys_creep;     // fluencia final como fracción de la carga
+    double phys_creep_tau; // constante de tiempo de la fluencia, s
+    double phys_tol;       // tolerancia para declarar estable, kg
+    double phys_hold;      // tiempo medio entre cambios de carga, s
+
     // Formato de salida
     const char *prefix;
     const char *suffix;
@@ -37,10 +189,13 @@ typedef struct {
     const char *msg_default_values;
     const char *msg_usage;
     const char *msg_sending;
+    const char *msg_sending_mixed;
     const char *msg_pause;
     const char *msg_resume;
     const char *msg_reset;
     const char *msg_exit;
+    const char *msg_summary;
+    const char *msg_wire;
 
     // Códigos de color ANSI
     const char *color_pause;
@@ -56,9 +211,31 @@ Config cfg = {
     .reset_value   = 0.0,
 
     .update_interval = 1,
+    .period_ns      = 0,
+    .catch_up       = 1,
+    .overflow_policy = OVERFLOW_DROP_OLDEST,
+    .outq_limit     = 256,
+
+    .baud           = BAUDRATE,
+    .parity         = 'n',
+    .data_bits      = 8,
+    .stop_bits      = 1,
+    .flow           = FLOW_NONE,
+    .cap_to_line    = 1,
+
+    .echo_mode      = ECHO_ALL,
+    .echo_every     = 100,
     .step_value     = 1,
     .paused         = 0,
 
+    .phys_freq      = 1.5,
+    .phys_damping   = 0.3,
+    .phys_noise     = 0.05,
+    .phys_creep     = 0.0005,
+    .phys_creep_tau = 30.0,
+    .phys_tol       = 0.2,
+    .phys_hold      = 5.0,
+
     .prefix        = "ST,NT,",
     .suffix        = "kg\r\n",
     .num_width     = 7,
@@ -67,12 +244,27 @@ Config cfg = {
 
     // Mensajes
     .msg_default_values = "Usando valores por defecto: intervalo=%ds, paso=%dkg\n",
-    .msg_usage          = "Recuerda: puedes correr el programa así:\nsudo %s <intervalo 1-10s> <paso 1-10kg>\n",
-    .msg_sending        = "Enviando cada %ds, paso %dkg (+ decimal aleatorio ±0.9). Ctrl+C para salir.\n",
+    .msg_usage          = "Recuerda: puedes correr el programa así:\nsudo %s [-d dispositivo]... [-f hz | -u periodo_us] [-a recuperar|saltar]\n"
+                          "    [-o viejas|nuevas|detener] [-q bytes_cola_tty] [-b baudios] [--linea 8N1]\n"
+                          "    [--flujo ninguno|rtscts|xonxoff] [--capacidad ajustar|avisar] [-s semilla]\n"
+                          "    [-e todo|eventos|nada|N] [-r traza.bin] [--volcar-traza traza.bin[:puerto]]\n"
+                          "    [-p traza.bin|log.txt] [--velocidad N|max] [--pty N] [--pty-enlace /tmp/balanza]\n"
+                          "    [--tcp puerto] [--tcp-lento cortar|saltar] [--udp grupo:puerto] [--shm /nombre]\n"
+                          "    [--control /ruta.sock] [--metricas [ip:]puerto] [--modelo rampa|fisico]\n"
+                          "    [--escenario archivo] [--protocolo nt|gtn|toledo|suma] [--hilos N]\n"
+                          "    [--io writev|uring] [--adelanto N] [--estres parejo|azar|rafaga:N]\n"
+                          "    [--fallas corromper|truncar|sin-fin|ruido|duplicar|reordenar|detener=p,...]\n"
+                          "    [-B | --bench-json resultado.json]\n"
+                          "    [--validar -d puerto... [-r recibida.bin]] [--comparar enviada.bin,recibida.bin]\n"
+                          "    <intervalo 1-10s> <paso 1-10kg>\n",
+    .msg_sending        = "Enviando cada %s, paso %dkg (+ decimal aleatorio ±0.9). Ctrl+C para salir.\n",
+    .msg_sending_mixed  = "Enviando cada %s a %s, paso %.1f a %.1fkg según la balanza. Ctrl+C para salir.\n",
     .msg_pause          = " -> Pausa: %s%s",
     .msg_resume         = " -> Reanuda: %s%s",
     .msg_reset          = " -> Reset manual: %s%s",
     .msg_exit           = "\nPuerto cerrado. Saliendo...\n",
+    .msg_wire           = "Línea %d %d%c%d: %d bytes por trama = %.2fms en el cable (máx %.1f tramas/s)\n",
+    .msg_summary        = "%s: %lu tramas, %lu plazos perdidos, %lu descartadas, %lu demoradas, %lu escrituras parciales, %lu errores\n",
 
     // Colores ANSI
     .color_pause    = "\033[33m",   // amarillo
@@ -81,18 +273,559 @@ Config cfg = {
     .color_reset_all= "\033[0m"     // reinicia color
 };
 
-int fd;
+// Trama preformateada: prefijo + signo + número de ancho fijo + sufijo.
+// Sólo el signo y los dígitos se reescriben, siempre en los mismos offsets.
+typedef struct {
+    char bytes[FRAME_MAX];
+    int len;               // largo de la trama actual
+    int fixed_len;         // largo con el número dentro del ancho fijo
+    int sign_off;          // offset del signo (en toledo, de los dígitos)
+    int width;             // ancho del número sin el signo
+    int line_len;          // gtn: distancia entre las líneas bruto/tara/neto
+    int chk_off;           // suma: offset del '*' que precede al checksum
+    int proto;             // índice en protocols[] de la plantilla armada
+} Frame;
+
+// Generador xoshiro256** propio de cada balanza: reproducible con --semilla
+// y sin el estado global compartido de rand().
+typedef struct {
+    uint64_t s[4];
+} Rng;
+
+// Cola de mensajes de consola: el bucle escribe y un hilo aparte vuelca a
+// stdout. Un productor y un consumidor, así que bastan dos índices atómicos;
+// si la cola está llena el mensaje se descarta y se cuenta, nunca se espera.
+typedef struct {
+    uint16_t len;
+    char text[LOG_LINE];
+} LogEntry;
+
+typedef struct {
+    LogEntry entries[LOG_SLOTS];
+    unsigned int head;     // lo avanza el hilo de consola
+    unsigned int tail;     // lo avanza el bucle
+    unsigned long lost;
+    int active;            // sin hilo de consola se escribe directo a stdout
+    int stop;
+    pthread_t thread;
+} LogRing;
+
+// Histograma logarítmico de tiempos en ns. Lo escribe sólo el bucle que
+// atiende el puerto (stores relajados, sin locks); cualquiera lo puede leer.
+typedef struct {
+    uint32_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Hist;
+
+// Datos de cada trama en la cola de salida
+typedef struct {
+    long long deadline_ns;
+    int32_t decimas;
+    uint8_t status;
+    uint8_t fault;         // FAULT_*: cómo sale la trama al cable (ver fault_pieces)
+    uint8_t fault_pos;     // byte dañado, largo que sale o largo del ruido
+    uint8_t fault_arg;     // offset en fault_noise
+} FrameMeta;
+
+// Archivo de traza: cabecera fija seguida de registros de 16 bytes, todo
+// en el orden de bytes de la máquina que graba.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t n_ports;
+    uint32_t reserved;
+    int64_t period_ns;
+    int64_t start_ns;      // CLOCK_MONOTONIC al abrir la traza
+    char pad[24];
+} TraceHeader;
+
+typedef struct {
+    int64_t t_ns;          // CLOCK_MONOTONIC al empezar la escritura que completó la trama
+    uint16_t port;
+    uint8_t status;
+    uint8_t flags;
+    int32_t decimas;
+} TraceRecord;
+
+// Grabador con doble buffer: el bucle llena uno mientras un hilo escribe el
+// otro con un solo write() de 1 MiB. Si el hilo no terminó a tiempo los
+// registros se cuentan como perdidos en vez de frenar el envío.
+typedef struct {
+    int fd;
+    TraceRecord *buf[2];
+    int active;            // buffer que llena el bucle
+    int fill;
+    int pending;           // registros del otro buffer esperando escritura (0 = libre)
+    int stop;
+    unsigned long records;
+    unsigned long lost;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} Recorder;
+
+// Traza mapeada en memoria para reproducir: binaria del grabador o log de
+// texto con tramas "ST,NT,...kg". Se recorre sin copiar; cada balanza sólo
+// guarda su posición.
+typedef struct {
+    const char *map;
+    size_t size;
+    int binary;
+    const TraceRecord *recs;
+    size_t n_recs;
+    uint32_t n_ports;
+    int64_t t_base;        // start_ns de la cabecera: origen de las marcas de tiempo
+    double speed;          // multiplicador; 0 = lo más rápido que aguanta la línea
+    long long start_ns;    // instante local que corresponde a t_base
+    int timed;             // respetar las marcas de tiempo de la traza
+    int active_scales;     // balanzas que todavía no llegan al final
+} Replay;
+
+// Modo estrés (--estres): cada puerto sube su frecuencia por escalones
+// hasta la capacidad de la línea y se anota qué logró en cada uno
+enum { STRESS_OFF, STRESS_EVEN, STRESS_BURST, STRESS_RANDOM };
+
+typedef struct {
+    int pattern;
+    int burst;             // tramas seguidas por plazo (1 salvo con rafaga:N)
+    int active_scales;     // balanzas que todavía no terminan la curva
+} Stress;
+
+// Un escalón de la curva de capacidad
+typedef struct {
+    double hz;             // tramas/s pedidas
+    double achieved;       // tramas/s enviadas completas
+    unsigned long lost;    // descartadas o demoradas: la línea o el lector no dan abasto
+    unsigned long missed;  // plazos vencidos: el simulador no da abasto
+    unsigned long short_writes;
+    int kernel_queue;      // bytes en la cola del tty al cerrar el escalón
+} StressStep;
+
+typedef struct {
+    StressStep steps[STRESS_MAX_STEPS];
+    int n_steps;
+    long long step_start, step_end;
+    long long due;         // con azar: próximo plazo
+    Rng rng;               // huecos al azar; aparte, así los pesos no cambian
+    unsigned long frames0, lost0, missed0, short0;
+    int warm;              // ya pasó STRESS_WARMUP_NS
+    int done;
+} StressState;
+
+// Cliente TCP suscrito a una balanza. No tiene buffer propio: sólo la
+// posición en la historia compartida de su balanza.
+typedef struct {
+    int fd;
+    int scale;             // -1 = ranura libre
+    int next;              // siguiente cliente de la misma balanza, o libre
+    uint64_t pos;          // bytes de la historia ya enviados
+    int want_out;
+} Client;
+
+// Salida de red de una balanza: cada trama se copia una sola vez a la
+// historia y todos los clientes envían desde ahí.
+typedef struct {
+    char *ring;
+    uint64_t head;         // bytes publicados desde el arranque
+    uint64_t last_frame;   // inicio de la última trama publicada
+    int listen_fd;
+    int clients;           // primer cliente de la lista (-1 = ninguno)
+    unsigned long accepted;
+    unsigned long cut;     // clientes cortados por lentos o caídos
+    unsigned long skipped; // bytes saltados a clientes lentos
+    unsigned long udp_errors;
+} NetOut;
+
+// Texto que crece a medida que se escribe (respuestas de control y métricas)
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} TextBuf;
+
+// Conexión al socket de control: comandos de texto, uno por línea. Las
+// respuestas se encolan en out y salen a medida que el cliente las lee.
+typedef struct {
+    int fd;                // -1 = libre
+    int len;
+    char buf[CONTROL_LINE];
+    TextBuf out;
+    size_t out_off;        // bytes de out ya enviados
+} ControlConn;
+
+// Conexión HTTP al endpoint de métricas: se lee la petición, se arma la
+// respuesta entera y se cierra al terminar de enviarla
+typedef struct {
+    int fd;                // -1 = libre
+    int len;
+    char req[METRICS_REQUEST];
+    char *out;             // respuesta; NULL mientras se lee la petición
+    size_t out_len, out_off;
+} MetricsConn;
+
+// Escenario (--escenario archivo): qué balanzas hay y cómo se comporta cada
+// una. Se lee una vez a structs compactos por balanza; con SIGHUP se vuelve
+// a leer y se reemplaza entero, sin pausar el envío ni reabrir puertos.
+typedef struct {
+    long long at_ns;       // desde que arrancó (o se recargó) el escenario
+    int op;                // CMD_PAUSE .. CMD_RESET
+    int64_t value;
+} ScenarioEvent;
+
+typedef struct {
+    long long period_ns;
+    long long line_ns;     // tiempo en el cable de una trama de su protocolo
+    long long cycle_ns;    // 0 = los eventos corren una sola vez
+    int32_t step_d;        // paso de la rampa, décimas
+    int32_t limit_d;       // al superarlo en valor absoluto vuelve a reset_d
+    int32_t reset_d;
+    int32_t start_min_d, start_max_d;   // peso inicial (sólo al arrancar)
+    uint8_t proto;         // índice en protocols[]
+    uint8_t model;         // índice en models[]
+    int first_event;       // eventos del grupo en Scenario.events
+    int n_events;
+} ScaleParams;
+
+typedef struct {
+    int n;                 // balanzas
+    const char **ports;    // dispositivo de cada balanza, NULL = PTY
+    ScaleParams *params;
+    ScenarioEvent *events; // por grupo, ordenados por at_ns
+    int n_events;
+    unsigned int generation;
+} Scenario;
+
+// Estado de cada balanza simulada
+typedef struct {
+    const char *device;
+    int fd;                // puerto serie o maestro del PTY
+    int peer_fd;           // esclavo del PTY (-1 en puertos reales)
+    char *link;            // enlace simbólico publicado al esclavo
+    int tfd;               // timerfd que marca el ritmo de envío
+    int32_t decimas;       // peso actual en décimas de kg
+    int32_t tare;          // tara en décimas; el neto es decimas - tare
+    uint8_t status;
+    Rng rng;
+    int8_t steps[RNG_BLOCK];  // decimales aleatorios (-9..9) ya generados
+    int step_pos;
+    long long period_ns;   // cada balanza puede cambiar su ritmo por control
+    long long start_ns;    // primer plazo; el plazo k es start_ns + k * periodo
+    unsigned long tick;    // índice del próximo plazo
+    int paused;
+    long long deadline_ns; // plazo de la trama que se está generando
+
+    // Parámetros del escenario, copiados por el shard de la balanza
+    int32_t step_d, limit_d, reset_d;
+    uint8_t proto;         // índice en protocols[]
+    uint8_t model;         // índice en models[]
+    long long line_ns;     // tope de frecuencia del protocolo (tasa, --estres)
+    const ScenarioEvent *events;  // en el escenario vigente (ver scenario_publish)
+    int n_events;
+    int next_event;
+    long long events_t0;   // instante que corresponde a at_ns = 0
+    long long cycle_ns;
+    long long event_due;   // próximo evento; LLONG_MAX = ninguno
+
+    // Cola de salida: cada ranura es una plantilla que se codifica en su
+    // lugar y se envía con writev junto a las demás pendientes.
+    Frame outq[OUTQ_SLOTS];
+    FrameMeta outq_meta[OUTQ_SLOTS];
+    unsigned int q_head;   // próxima trama a escribir
+    unsigned int q_tail;   // próxima ranura libre
+    int q_off;             // bytes ya escritos de la trama q_head
+    int ready;             // tramas ya codificadas a partir de q_tail (--adelanto)
+    int32_t ahead_d;       // peso de la rampa tras la última trama adelantada
+    int want_out;          // EPOLLOUT armado
+    int dead;              // el puerto colgó (adaptador desenchufado): ya no se escribe
+    int kq_bound;          // cota de los bytes en la cola del kernel (ver port_full)
+    unsigned int inflight; // io_uring: tramas de la escritura en curso
+    unsigned int wiov_n;   // io_uring: iovec de la escritura en curso
+    long long w_start;     // io_uring: instante en que se preparó la escritura
+    struct iovec wiov[OUTQ_IOV];  // io_uring: iovec vivo hasta la respuesta
+    unsigned long stalled; // tramas retenidas por OVERFLOW_STALL
+
+    size_t replay_pos;     // próximo registro (binaria) o byte (texto)
+    uint32_t replay_port;  // puerto de la traza que reproduce esta balanza
+    int replay_done;
+
+    unsigned long produced; // tramas generadas
+    unsigned long frames;  // tramas enviadas completas
+    unsigned long missed;  // plazos vencidos sin trama propia
+    unsigned long dropped; // tramas descartadas por cola llena
+    unsigned long delayed; // tramas demoradas por cola llena
+    unsigned long short_writes;
+    unsigned long write_errors;
+    unsigned long long bytes; // bytes escritos al puerto
+    unsigned long resets_auto;    // la rampa pasó el límite (con --adelanto, al generarla)
+    unsigned long resets_manual;  // reset por teclado, control o escenario
+    StressState *stress;   // NULL salvo con --estres
+
+    // --fallas: generador propio, así la secuencia de pesos no cambia
+    Rng fault_rng;
+    int held;              // la última trama de la cola espera a la siguiente (reordenar)
+    long long stall_until; // puerto detenido hasta este instante
+    unsigned long faults[N_FAULTS];
+
+    Hist jitter;           // inicio de escritura - plazo
+    Hist write_lat;        // fin de escritura - inicio de escritura
+    unsigned int hist_gen; // hist_generation de la última vez que se vaciaron
+
+    NetOut net;
+} __attribute__((aligned(64))) Scale;
+
+// Comando de control ya interpretado por el hilo principal. scale = -1
+// aplica a todas las balanzas del shard.
+enum { CMD_PAUSE, CMD_RESUME, CMD_LOAD, CMD_TARE, CMD_RATE, CMD_RESET, CMD_SCENARIO };
+
+// Nombres de los comandos en los eventos de un escenario
+static const char *const command_names[] = { "pausa", "reanuda", "carga", "tara", "tasa", "reset" };
+
+typedef struct {
+    int op;
+    int scale;
+    int64_t value;         // décimas (CMD_LOAD, CMD_TARE), periodo en ns (CMD_RATE)
+                           // o generación (CMD_SCENARIO)
+} Command;
+
+
+// Hilo principal -> shard: un productor y un consumidor, como LogRing
+typedef struct {
+    Command slots[CMD_SLOTS];
+    unsigned int head;     // lo avanza el shard
+    unsigned int tail;     // lo avanza el hilo principal
+} CmdRing;
+
+// io_uring sin liburing: los dos anillos mapeados y los punteros a sus
+// índices. El shard prepara una escritura por puerto y las envía todas
+// juntas con un io_uring_enter al final de cada vuelta del bucle.
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned pending;      // preparadas y todavía no enviadas
+    void *sq_map, *cq_map;
+    size_t sq_size, cq_size;
+    unsigned long enters;
+    unsigned long writes;
+} Uring;
+
+// Shard: un hilo, opcionalmente fijo a un núcleo, que atiende un rango
+// contiguo de balanzas con su propio epoll. Puertos, timers, generadores,
+// modelo, clientes TCP, consola y grabador son sólo suyos; con el resto del
+// proceso comparte únicamente su cola de comandos.
+typedef struct {
+    int id;
+    int first, count;      // balanzas [first, first + count)
+    int epfd;
+    int cmd_fd;            // eventfd: hay comandos en la cola
+    CmdRing cmds;
+    LogRing *log;
+    Recorder *recorder;
+    int free_client;       // lista de clientes TCP libres de este shard
+    long long phys_steps;  // pasos del modelo físico ya corridos
+    Rng phys_rng;
+    int cpu;               // -1 = sin fijar
+    Uring *ring;           // NULL = writev
+    unsigned long syscalls;  // llamadas al sistema del camino de envío
+    unsigned int scenario_gen;  // último escenario aplicado (lo lee scenario_publish)
+    int *refill;           // balanzas que enviaron en esta vuelta (--adelanto)
+    int n_refill;
+    pthread_t thread;
+} __attribute__((aligned(64))) Shard;
+
+Scale scales[MAX_SCALES];
+int n_scales = 0;
+__thread int epfd = -1;    // cada hilo atiende su propio epoll
+__thread Shard *self;      // shard del hilo actual (NULL en el principal)
 int running = 1;
+int wake_fd = -1;          // eventfd: un shard pide terminar al hilo principal
+Shard *shards;
+int n_shards = 1;
+int pin_shards = 0;
+int sig_fd = -1;
+unsigned int hist_generation;  // SIGUSR2 la avanza; cada balanza vacía sus histogramas al verla
+long long line_ns;         // tiempo en el cable de una trama
+int control_fd = -1;
+ControlConn control_conns[MAX_CONTROL];
+int metrics_fd = -1;
+MetricsConn metrics_conns[MAX_METRICS_CONN];
 struct termios orig_termios;
+LogRing logring;          // hilo principal; controla además el hilo de consola
+__thread LogRing *log_ring = &logring;
+LogRing *log_rings[MAX_SHARDS + 1] = { &logring };
+int n_log_rings = 1;
+int trace_fd = -1;
+Replay replay;
+Stress stress = { .burst = 1 };
+uint8_t fault_noise[FAULT_NOISE];  // ruido de --fallas: sin '\n', '\r' ni ',' y sin dos bytes iguales seguidos
+Client clients[MAX_CLIENTS];
+int udp_fd = -1;
+BalanzaShmSlot *shm_slots = NULL;
+size_t shm_size;
 
-void cleanup(int signo) {
-    running = 0;
-    if (fd > 0) close(fd);
-    tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios);
-    printf("%s", cfg.msg_exit);
-    exit(0);
+uint64_t seed;
+
+// Límites de Config convertidos a décimas al arrancar
+int32_t reset_limit_d;
+int32_t reset_value_d;
+
+// Desde cualquier hilo: los shards ven running en cero al despertar y el
+// hilo principal se despierta con wake_fd
+void request_stop(void) {
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    eventfd_write(wake_fd, 1);
+}
+
+static inline int log_enabled(int level) {
+    if (level == LOG_ALWAYS) return 1;
+    if (cfg.echo_mode == ECHO_NONE) return 0;
+    if (level == LOG_EVENT) return 1;
+    return cfg.echo_mode == ECHO_ALL || cfg.echo_mode == ECHO_SAMPLED;
+}
+
+void log_write(int level, const char *text, int len) {
+    if (!log_enabled(level)) return;
+    if (len > LOG_LINE) len = LOG_LINE;
+    if (!logring.active) {
+        fwrite(text, 1, len, stdout);
+        return;
+    }
+    LogRing *ring = log_ring;
+    unsigned int tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_SLOTS) {
+        ring->lost++;
+        return;
+    }
+    LogEntry *e = &ring->entries[tail % LOG_SLOTS];
+    memcpy(e->text, text, len);
+    e->len = len;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void log_msg(int level, const char *fmt, ...) {
+    if (!log_enabled(level)) return;
+    char text[LOG_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    log_write(level, text, len < LOG_LINE ? len : LOG_LINE - 1);
+}
+
+// Vacía las colas de todos los hilos; el orden se respeta dentro de cada una
+void *log_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        int idle = 1;
+        for (int r = 0; r < n_log_rings; r++) {
+            LogRing *ring = log_rings[r];
+            unsigned int head = ring->head;
+            unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            if (head == tail) continue;
+            idle = 0;
+            for (; head != tail; head++) {
+                LogEntry *e = &ring->entries[head % LOG_SLOTS];
+                fwrite(e->text, 1, e->len, stdout);
+            }
+            __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        }
+        if (idle) {
+            fflush(stdout);
+            if (__atomic_load_n(&logring.stop, __ATOMIC_ACQUIRE)) break;
+            struct timespec ts = { 0, 2000000 };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+// El hilo de consola bloquea todas las señales: las atiende el bucle
+void log_start(void) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&logring.thread, NULL, log_thread, NULL) != 0) {
+        fprintf(stderr, "Error: no se pudo crear el hilo de consola.\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    logring.active = 1;
+}
+
+// Espera a que el hilo vacíe la cola; desde ahí los mensajes van directo
+void log_stop(void) {
+    if (!logring.active) return;
+    __atomic_store_n(&logring.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(logring.thread, NULL);
+    logring.active = 0;
+    unsigned long lost = 0;
+    for (int r = 0; r < n_log_rings; r++) lost += log_rings[r]->lost;
+    if (lost) printf("%lu mensajes de consola descartados\n", lost);
+}
+
+static inline int hist_index(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS)) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    int idx = ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// Mayor valor que cae en el bucket idx
+uint64_t hist_value(int idx) {
+    if (idx < (1 << HIST_SUB_BITS)) return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    uint64_t sub = (idx & ((1 << HIST_SUB_BITS) - 1)) | (1u << HIST_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void hist_record(Hist *h, long long v) {
+    uint64_t u = v > 0 ? (uint64_t)v : 0;
+    int idx = hist_index(u);
+    __atomic_store_n(&h->counts[idx], h->counts[idx] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    if (u > h->max) __atomic_store_n(&h->max, u, __ATOMIC_RELAXED);
+}
+
+uint64_t hist_percentile(const Hist *h, double p) {
+    uint64_t total = __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+    if (total == 0) return 0;
+    uint64_t target = (uint64_t)ceil(total * p);
+    if (target == 0) target = 1;
+    uint64_t acc = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        acc += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (acc >= target) {
+            uint64_t v = hist_value(i);
+            uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            return v < max ? v : max;
+        }
+    }
+    return __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+void hist_print(const char *name, const Hist *h) {
+    log_msg(LOG_ALWAYS, "  %-10s n=%-8llu p50=%8.1fus p99=%8.1fus p999=%8.1fus max=%8.1fus\n", name,
+           (unsigned long long)__atomic_load_n(&h->total, __ATOMIC_RELAXED),
+           hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3,
+           hist_percentile(h, 0.999) / 1e3, __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3);
 }
 
+// Volcado de histogramas: con SIGUSR1 (kill -USR1 <pid>) y al salir
+void dump_histograms(void) {
+    for (int i = 0; i < n_scales; i++) {
+        log_msg(LOG_ALWAYS, "%s:\n", scales[i].device);
+        hist_print("jitter", &scales[i].jitter);
+        hist_print("escritura", &scales[i].write_lat);
+    }
+}
+
+
 void disable_raw_mode() { tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios); }
 void enable_raw_mode() {
     tcgetattr(STDIN_FILENO, &orig_termios);
@@ -102,31 +835,100 @@ void enable_raw_mode() {
     tcsetattr(STDIN_FILENO, TCSANOW, &raw);
 }
 
-int kbhit() {
-    struct timeval tv = {0L, 0L};
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
-    return select(STDIN_FILENO+1, &fds, NULL, NULL, &tv) > 0;
+speed_t baud_to_speed(int baud) {
+    static const struct { int baud; speed_t speed; } table[] = {
+        { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+        { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+        { 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+        { 921600, B921600 },
+    };
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++)
+        if (table[i].baud == baud) return table[i].speed;
+    return 0;
 }
 
-int setup_serial(const char *device) {
-    int fd = open(device, O_RDWR | O_NOCTTY);
-    if (fd == -1) { perror("No se puede abrir el puerto serie"); exit(1); }
-    fcntl(fd, F_SETFL, 0);
+// Bits en el cable por cada byte: inicio + datos + paridad + parada
+int bits_per_char(void) {
+    return 1 + cfg.data_bits + (cfg.parity != 'n') + cfg.stop_bits;
+}
+
+// Tiempo que tarda una trama de len bytes en salir por la línea
+long long wire_time_ns(int len) {
+    return (long long)len * bits_per_char() * 1000000000LL / cfg.baud;
+}
+
+void apply_line_settings(int fd) {
     struct termios options;
     tcgetattr(fd, &options);
-    cfsetispeed(&options, BAUDRATE);
-    cfsetospeed(&options, BAUDRATE);
+    cfsetispeed(&options, baud_to_speed(cfg.baud));
+    cfsetospeed(&options, baud_to_speed(cfg.baud));
     options.c_cflag |= (CLOCAL | CREAD);
-    options.c_cflag &= ~PARENB;
-    options.c_cflag &= ~CSTOPB;
+    options.c_cflag &= ~(PARENB | PARODD);
+    if (cfg.parity != 'n') options.c_cflag |= PARENB;
+    if (cfg.parity == 'o') options.c_cflag |= PARODD;
+    if (cfg.stop_bits == 2) options.c_cflag |= CSTOPB;
+    else options.c_cflag &= ~CSTOPB;
     options.c_cflag &= ~CSIZE;
-    options.c_cflag |= CS8;
+    options.c_cflag |= (cfg.data_bits == 7 ? CS7 : CS8);
+    if (cfg.flow == FLOW_RTSCTS) options.c_cflag |= CRTSCTS;
+    else options.c_cflag &= ~CRTSCTS;
     options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
     options.c_iflag &= ~(IXON | IXOFF | IXANY | ICRNL | INLCR);
+    if (cfg.flow == FLOW_XONXOFF) options.c_iflag |= (IXON | IXOFF);
     options.c_oflag &= ~OPOST;
     tcsetattr(fd, TCSANOW, &options);
+}
+
+// Par de pseudoterminales que se comporta como un puerto serie: el
+// simulador escribe en el maestro y el consumidor abre el esclavo, que
+// queda con la misma configuración de línea que un puerto real. El esclavo
+// se mantiene abierto para que el PTY no se cierre entre consumidores y
+// para medir los bytes que el consumidor todavía no leyó.
+int setup_pty(Scale *s, const char *link_prefix, int idx) {
+    int m = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (m == -1 || grantpt(m) == -1 || unlockpt(m) == -1) {
+        perror("No se puede crear el PTY");
+        exit(1);
+    }
+    char path[64];
+    if (ptsname_r(m, path, sizeof(path)) != 0) { perror("ptsname_r"); exit(1); }
+    s->peer_fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (s->peer_fd == -1) { fprintf(stderr, "%s: ", path); perror("No se puede abrir el esclavo"); exit(1); }
+    apply_line_settings(s->peer_fd);
+    s->device = strdup(path);
+
+    if (link_prefix) {
+        char link[4096];
+        snprintf(link, sizeof(link), "%s%d", link_prefix, idx);
+        unlink(link);
+        if (symlink(path, link) == -1) {
+            fprintf(stderr, "%s: ", link);
+            perror("No se puede crear el enlace");
+        } else {
+            s->link = strdup(link);
+        }
+    }
+    return m;
+}
+
+// Bytes que esperan salir: en un puerto real la cola de salida del tty, en
+// un PTY lo que el consumidor aún no leyó del esclavo.
+static inline int port_queued(const Scale *s) {
+    int queued = 0;
+    if (s->peer_fd >= 0) ioctl(s->peer_fd, FIONREAD, &queued);
+    else ioctl(s->fd, TIOCOUTQ, &queued);
+    return queued;
+}
+
+int setup_serial(const char *device) {
+    int fd = open(device, O_RDWR | O_NOCTTY);
+    if (fd == -1) {
+        fprintf(stderr, "%s: ", device);
+        perror("No se puede abrir el puerto serie");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    apply_line_settings(fd);
     return fd;
 }
 
@@ -142,74 +944,3902 @@ void format_num(double valor, char *out, int width) {
     strcpy(&out[pos], numstr);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc == 3) {
-        cfg.update_interval = atoi(argv[1]);
-        cfg.step_value = atoi(argv[2]);
-        if (cfg.update_interval < 1 || cfg.update_interval > 10) {
-            fprintf(stderr, "Error: intervalo debe estar entre 1 y 10 segundos.\n");
-            exit(1);
-        }
-        if (cfg.step_value < 1 || cfg.step_value > 10) {
-            fprintf(stderr, "Error: paso debe ser entero entre 1 y 10 kg.\n");
-            exit(1);
-        }
-    } else {
-        printf(cfg.msg_default_values, cfg.update_interval, cfg.step_value);
-        printf(cfg.msg_usage, argv[0]);
+static inline uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Cada balanza arranca de la semilla global mezclada con su índice
+void rng_seed(Rng *r, uint64_t base, uint64_t stream) {
+    uint64_t x = base ^ (stream * 0xd1b54a32d192ed03ULL);
+    for (int i = 0; i < 4; i++) r->s[i] = splitmix64(&x);
+}
+
+static inline uint64_t rng_next(Rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+// Uniforme en [0, 1)
+static inline double rng_double(Rng *r) {
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Llena un bloque con decimales aleatorios en -9..9 (décimas). Cada salida
+// de 64 bits rinde dos valores por multiplicación de 32 bits, sin divisiones.
+void rng_fill_steps(Rng *r, int8_t *out, int n) {
+    for (int i = 0; i < n; i += 2) {
+        uint64_t x = rng_next(r);
+        out[i] = (int8_t)((((x & 0xffffffffULL) * 19) >> 32) - 9);
+        if (i + 1 < n) out[i + 1] = (int8_t)((((x >> 32) * 19) >> 32) - 9);
+    }
+}
+
+static inline int32_t next_step(Scale *s) {
+    if (s->step_pos == RNG_BLOCK) {
+        rng_fill_steps(&s->rng, s->steps, RNG_BLOCK);
+        s->step_pos = 0;
     }
+    return s->steps[s->step_pos++];
+}
 
-    signal(SIGINT, cleanup);
-    srand(time(NULL));
-    enable_raw_mode();
-    fd = setup_serial(SERIAL_PORT);
+void frame_init(Frame *f) {
+    int pos = 0;
+    size_t plen = strlen(cfg.prefix), slen = strlen(cfg.suffix);
+    f->width = cfg.num_width;
+    if (plen + 1 + f->width + slen > FRAME_MAX) {
+        fprintf(stderr, "Error: trama de más de %d bytes.\n", FRAME_MAX);
+        exit(1);
+    }
+    memcpy(f->bytes, cfg.prefix, plen);
+    pos = plen;
+    f->sign_off = pos;
+    f->bytes[pos++] = '+';
+    memset(f->bytes + pos, ' ', f->width);
+    pos += f->width;
+    memcpy(f->bytes + pos, cfg.suffix, slen);
+    f->len = f->fixed_len = pos + slen;
+}
 
-    double valor = cfg.min_start + (rand() / (double)RAND_MAX) * (cfg.max_start - cfg.min_start);
-    char numbuf[64];
-    char buffer[128];
+// Número más ancho que el campo: igual que format_num(), sin relleno y
+// con el sufijo desplazado. La siguiente trama normal restaura la plantilla.
+int frame_encode_wide(Frame *f, int32_t decimas) {
+    char numbuf[32];
+    format_num(decimas / 10.0, numbuf, f->width);
+    size_t nlen = strlen(numbuf), slen = strlen(cfg.suffix);
+    if (f->sign_off + nlen + slen > FRAME_MAX) nlen = FRAME_MAX - f->sign_off - slen;
+    memcpy(f->bytes + f->sign_off, numbuf, nlen);
+    memcpy(f->bytes + f->sign_off + nlen, cfg.suffix, slen);
+    f->len = f->sign_off + nlen + slen;
+    return f->len;
+}
 
-    printf(cfg.msg_sending, cfg.update_interval, cfg.step_value);
-
-    while (running) {
-        if (!cfg.paused) {
-            double decimal_rand = ((rand() % 19) - 9) / 10.0;
-            valor += cfg.step_value + decimal_rand;
-
-            if (fabs(valor) >= cfg.reset_limit) valor = cfg.reset_value;
-
-            format_num(valor, numbuf, cfg.num_width);
-            snprintf(buffer, sizeof(buffer), "%s%skg\r\n", cfg.prefix, numbuf);
-
-            write(fd, buffer, strlen(buffer));
-            printf("Enviado: %s", buffer);
-        }
-
-        if (kbhit()) {
-            char c = getchar();
-            format_num(valor, numbuf, cfg.num_width);
-
-            if (c == cfg.reset_key) {
-                valor = cfg.reset_value;
-                printf("%s", cfg.color_reset);
-                printf(cfg.msg_reset, numbuf, cfg.suffix);
-                printf("%s", cfg.color_reset_all);
-            } else if (c == cfg.pause_key || c == toupper(cfg.pause_key)) {
-                cfg.paused = !cfg.paused;
-                if (cfg.paused) {
-                    printf("%s", cfg.color_pause);
-                    printf(cfg.msg_pause, numbuf, cfg.suffix);
-                    printf("%s", cfg.color_reset_all);
-                } else {
-                    printf("%s", cfg.color_resume);
-                    printf(cfg.msg_resume, numbuf, cfg.suffix);
-                    printf("%s", cfg.color_reset_all);
-                }
+// Codifica el peso en la plantilla sin snprintf ni copias: los dígitos se
+// escriben de derecha a izquierda y el resto del campo se rellena con
+// espacios. Devuelve el largo de la trama, idéntica a la de format_num().
+static inline int put_weight(char *num, int width, int32_t decimas) {
+    uint32_t v = decimas < 0 ? -(uint32_t)decimas : (uint32_t)decimas;
+    char *p = num + width;
+
+    num[0] = decimas < 0 ? '-' : '+';
+    *p-- = '0' + v % 10;
+    v /= 10;
+    *p-- = '.';
+    do {
+        *p-- = '0' + v % 10;
+        v /= 10;
+    } while (v && p > num);
+    if (v) return 0;
+    while (p > num) *p-- = ' ';
+    return 1;
+}
+
+static inline int frame_encode(Frame *f, int32_t decimas) {
+    if (f->len != f->fixed_len) frame_init(f);
+    if (!put_weight(f->bytes + f->sign_off, f->width, decimas)) return frame_encode_wide(f, decimas);
+    return f->len;
+}
+
+// El estado va en los dos primeros bytes del prefijo ("ST,NT," -> "US,NT,")
+static inline void frame_set_status(Frame *f, uint8_t status) {
+    if (f->sign_off >= 2) memcpy(f->bytes, status == STATUS_ST ? cfg.prefix : status_code[status], 2);
+}
+
+// Protocolos de indicador. Cada uno arma en init() la plantilla con las
+// partes fijas y su encode() sólo reescribe campos en offsets conocidos;
+// los formatos se arman con los mismos helpers inline, así que cada encoder
+// queda especializado por el compilador con sus constantes.
+//   nt      "ST,NT,+  123.4kg\r\n" (neto = bruto - tara)
+//   gtn     tres líneas bruto (GS), tara (TR) y neto (NT)
+//   toledo  salida continua: STX SWA SWB SWC peso(6) tara(6) CR checksum
+//   suma    como nt, con "*HH" (XOR de los bytes anteriores) antes del CR LF
+
+// Número fuera del campo: en los formatos sin largo variable se satura
+static inline void put_weight_sat(char *num, int width, int32_t decimas) {
+    if (put_weight(num, width, decimas)) return;
+    int32_t max = 1;
+    for (int i = 1; i < width; i++) max *= 10;
+    put_weight(num, width, decimas < 0 ? -(max - 1) : max - 1);
+}
+
+// n dígitos con ceros a la izquierda
+static inline void put_digits(char *out, uint32_t v, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        out[i] = '0' + v % 10;
+        v /= 10;
+    }
+}
+
+static inline void put_status(char *line, uint8_t status) {
+    memcpy(line, status == STATUS_ST ? cfg.prefix : status_code[status], 2);
+}
+
+int nt_encode(Frame *f, int32_t gross, int32_t tare, uint8_t status) {
+    int len = frame_encode(f, gross - tare);
+    frame_set_status(f, status);
+    return len;
+}
+
+void gtn_init(Frame *f) {
+    static const char tag[3][3] = { "GS", "TR", "NT" };
+    frame_init(f);
+    int line = f->fixed_len;
+    if (3 * line > FRAME_MAX) {
+        fprintf(stderr, "Error: trama de más de %d bytes.\n", FRAME_MAX);
+        exit(1);
+    }
+    for (int k = 0; k < 3; k++) {
+        memcpy(f->bytes + k * line, f->bytes, line);
+        if (f->sign_off >= 5 && f->bytes[2] == ',') memcpy(f->bytes + k * line + 3, tag[k], 2);
+    }
+    f->line_len = line;
+    f->len = f->fixed_len = 3 * line;
+}
+
+int gtn_encode(Frame *f, int32_t gross, int32_t tare, uint8_t status) {
+    const int32_t v[3] = { gross, tare, gross - tare };
+    for (int k = 0; k < 3; k++) {
+        char *line = f->bytes + k * f->line_len;
+        put_weight_sat(line + f->sign_off, f->width, v[k]);
+        if (f->sign_off >= 2) put_status(line, status);
+    }
+    return f->len;
+}
+
+void toledo_init(Frame *f) {
+    memset(f, 0, sizeof(*f));
+    f->bytes[0] = 0x02;
+    f->bytes[1] = 0x20 | 0x08 | 0x03;  // SWA: incremento x1, punto en XXXXX.X
+    f->bytes[3] = 0x20;                // SWC
+    f->bytes[16] = '\r';
+    f->sign_off = 4;
+    f->width = 6;
+    f->len = f->fixed_len = 18;
+}
+
+// Con tara se informa el neto (SWB bit 0). Checksum: complemento a dos de
+// la suma de STX..CR, en 7 bits.
+int toledo_encode(Frame *f, int32_t gross, int32_t tare, uint8_t status) {
+    unsigned char *b = (unsigned char *)f->bytes;
+    int32_t shown = tare ? gross - tare : gross;
+    uint32_t w = shown < 0 ? -(uint32_t)shown : (uint32_t)shown;
+    uint32_t t = tare < 0 ? -(uint32_t)tare : (uint32_t)tare;
+    int over = status == STATUS_OL || w > 999999;
+    if (w > 999999) w = 999999;
+    if (t > 999999) t = 999999;
+
+    b[2] = 0x20 | 0x10 | (tare != 0) | (shown < 0) << 1 | over << 2 | (status == STATUS_US) << 3;
+    put_digits(f->bytes + 4, w, 6);
+    put_digits(f->bytes + 10, t, 6);
+    unsigned sum = 0;
+    for (int i = 0; i < 17; i++) sum += b[i];
+    b[17] = -sum & 0x7f;
+    return 18;
+}
+
+// El terminador (CR/LF al final del sufijo) va después del checksum
+void sum_init(Frame *f) {
+    frame_init(f);
+    int end = f->fixed_len;
+    while (end > f->sign_off + f->width + 1 && (f->bytes[end - 1] == '\r' || f->bytes[end - 1] == '\n')) end--;
+    int term = f->fixed_len - end;
+    if (f->fixed_len + 3 > FRAME_MAX) {
+        fprintf(stderr, "Error: trama de más de %d bytes.\n", FRAME_MAX);
+        exit(1);
+    }
+    memmove(f->bytes + end + 3, f->bytes + end, term);
+    f->bytes[end] = '*';
+    f->chk_off = end;
+    f->len = f->fixed_len = end + 3 + term;
+}
+
+int sum_encode(Frame *f, int32_t gross, int32_t tare, uint8_t status) {
+    static const char hex[] = "0123456789ABCDEF";
+    put_weight_sat(f->bytes + f->sign_off, f->width, gross - tare);
+    frame_set_status(f, status);
+    unsigned char x = 0;
+    for (int i = 0; i < f->chk_off; i++) x ^= (unsigned char)f->bytes[i];
+    f->bytes[f->chk_off + 1] = hex[x >> 4];
+    f->bytes[f->chk_off + 2] = hex[x & 15];
+    return f->len;
+}
+
+typedef struct {
+    const char *name;
+    void (*init)(Frame *f);
+    int (*encode)(Frame *f, int32_t gross, int32_t tare, uint8_t status);
+} Protocol;
+
+const Protocol protocols[] = {
+    { "nt",     frame_init,  nt_encode },
+    { "gtn",    gtn_init,    gtn_encode },
+    { "toledo", toledo_init, toledo_encode },
+    { "suma",   sum_init,    sum_encode },
+};
+const Protocol *proto = &protocols[0];
+#define N_PROTOCOLS (sizeof(protocols) / sizeof(protocols[0]))
+
+// Reconoce una trama de texto "SS,TT,±   nnn.nkg" dentro de [p, end), con
+// o sin texto antes (por ejemplo "Enviado: "). Devuelve 1 si la encontró.
+int parse_frame_text(const char *p, const char *end, int32_t *decimas, uint8_t *status) {
+    const char *c1 = memchr(p, ',', end - p);
+    if (!c1 || c1 - p < 2) return 0;
+    const char *c2 = memchr(c1 + 1, ',', end - c1 - 1);
+    if (!c2) return 0;
+    const char *q = c2 + 1;
+    if (q >= end || (*q != '+' && *q != '-')) return 0;
+    int neg = *q++ == '-';
+    while (q < end && *q == ' ') q++;
+    int32_t v = 0;
+    int digits = 0;
+    while (q < end && *q >= '0' && *q <= '9') { v = v * 10 + (*q++ - '0'); digits++; }
+    if (!digits || q + 2 > end || q[0] != '.' || q[1] < '0' || q[1] > '9') return 0;
+    v = v * 10 + (q[1] - '0');
+    *decimas = neg ? -v : v;
+    if (c1[-2] == 'U' && c1[-1] == 'S') *status = STATUS_US;
+    else if (c1[-2] == 'O' && c1[-1] == 'L') *status = STATUS_OL;
+    else *status = STATUS_ST;
+    return 1;
+}
+
+int epoll_add(int fd, uint64_t tag) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Texto legible del periodo para los mensajes de consola
+void format_period(long long ns, char *out, size_t len) {
+    if (ns % 1000000000LL == 0) snprintf(out, len, "%llds", ns / 1000000000LL);
+    else if (ns % 1000000LL == 0) snprintf(out, len, "%lldms", ns / 1000000LL);
+    else snprintf(out, len, "%.3fms", ns / 1e6);
+}
+
+void arm_periodic(Scale *s, long long start_ns) {
+    s->start_ns = start_ns;
+    s->tick = 0;
+    struct itimerspec its = {
+        .it_interval = { s->period_ns / 1000000000LL, s->period_ns % 1000000000LL },
+        .it_value    = { start_ns / 1000000000LL, start_ns % 1000000000LL },
+    };
+    if (timerfd_settime(s->tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) { perror("timerfd_settime"); exit(1); }
+}
+
+// Arma el timer de una balanza con plazos absolutos: el kernel genera
+// start + k * periodo, así que el trabajo de cada trama no acumula deriva.
+// Las fases se reparten a lo largo del periodo para que N puertos no
+// despierten todos en el mismo instante; con io_uring van juntas, así las
+// tramas de un mismo plazo salen en un solo io_uring_enter.
+int setup_timer(Scale *s, int idx, int n) {
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) { perror("timerfd_create"); exit(1); }
+
+    s->tfd = tfd;
+    arm_periodic(s, now_ns() + (cfg.io_uring ? 0 : s->period_ns / n * idx));
+    return tfd;
+}
+
+void *recorder_thread(void *arg) {
+    Recorder *r = arg;
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (r->pending == 0 && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+        if (r->pending == 0) break;
+        TraceRecord *buf = r->buf[!r->active];
+        size_t bytes = (size_t)r->pending * sizeof(TraceRecord);
+        pthread_mutex_unlock(&r->lock);
+
+        const char *p = (const char *)buf;
+        while (bytes > 0) {
+            ssize_t w = write(r->fd, p, bytes);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                perror("Error grabando traza");
+                break;
             }
+            p += w;
+            bytes -= w;
         }
 
-        sleep(cfg.update_interval);
+        pthread_mutex_lock(&r->lock);
+        r->pending = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+// Crea el archivo con su cabecera. Cada shard graba con su propio Recorder
+// sobre el mismo descriptor (O_APPEND): los bloques de distintos shards se
+// intercalan, pero dentro de un puerto los registros quedan en orden.
+int trace_open(const char *path, int n_ports) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "%s: ", path);
+        perror("No se puede crear la traza");
+        exit(1);
+    }
+    TraceHeader h = { .version = TRACE_VERSION, .record_size = sizeof(TraceRecord),
+                      .n_ports = n_ports, .period_ns = cfg.period_ns, .start_ns = now_ns() };
+    memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+    if (write(fd, &h, sizeof(h)) != sizeof(h)) { perror("Error grabando traza"); exit(1); }
+    return fd;
+}
+
+Recorder *recorder_open(int fd) {
+    Recorder *r = calloc(1, sizeof(Recorder));
+    r->fd = fd;
+    for (int i = 0; i < 2; i++) r->buf[i] = malloc(TRACE_BUF_RECORDS * sizeof(TraceRecord));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_create(&r->thread, NULL, recorder_thread, r);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return r;
+}
+
+// Entrega el buffer lleno al hilo escritor. Sólo toma el lock una vez cada
+// TRACE_BUF_RECORDS registros.
+void recorder_swap(Recorder *r) {
+    pthread_mutex_lock(&r->lock);
+    if (r->pending) {
+        r->lost += r->fill;
+    } else {
+        r->pending = r->fill;
+        r->active = !r->active;
+        pthread_cond_signal(&r->cond);
+    }
+    r->fill = 0;
+    pthread_mutex_unlock(&r->lock);
+}
+
+static inline void recorder_add(Recorder *r, long long t_ns, int port, const FrameMeta *m, uint8_t flags) {
+    TraceRecord *rec = &r->buf[r->active][r->fill++];
+    rec->t_ns = t_ns;
+    rec->port = port;
+    rec->status = m->status;
+    rec->flags = flags;
+    rec->decimas = m->decimas;
+    r->records++;
+    if (r->fill == TRACE_BUF_RECORDS) recorder_swap(r);
+}
+
+void recorder_close(Recorder *r) {
+    // Esperar a que el hilo libere el otro buffer y escribir lo que quede
+    pthread_mutex_lock(&r->lock);
+    while (r->pending) {
+        pthread_mutex_unlock(&r->lock);
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (r->fill) recorder_swap(r);
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+}
+
+// Convierte una traza a las tramas de texto que se enviaron. Con
+// "archivo:N" sólo se muestran las del puerto N.
+int dump_trace(const char *arg) {
+    char path[4096];
+    int only_port = -1;
+    snprintf(path, sizeof(path), "%s", arg);
+    char *colon = strrchr(path, ':');
+    if (colon && colon[1] && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+        only_port = atoi(colon + 1);
+        *colon = '\0';
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { fprintf(stderr, "%s: ", path); perror("No se puede abrir la traza"); return 1; }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size < (off_t)sizeof(TraceHeader)) { fprintf(stderr, "%s: traza vacía\n", path); return 1; }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { perror("mmap"); return 1; }
+
+    const TraceHeader *h = (const TraceHeader *)map;
+    if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 || h->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: no es una traza de balanza\n", path);
+        return 1;
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+    const TraceRecord *rec = (const TraceRecord *)(map + sizeof(TraceHeader));
+    size_t n = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    Frame f;
+    frame_init(&f);
+    for (size_t i = 0; i < n; i++) {
+        if (only_port >= 0 && rec[i].port != only_port) continue;
+        if (rec[i].flags & TRACE_CORRUPT) continue;
+        int len = frame_encode(&f, rec[i].decimas);
+        frame_set_status(&f, rec[i].status % 3);
+        fwrite(f.bytes, 1, len, stdout);
+    }
+    munmap((void *)map, st.st_size);
+    return 0;
+}
+
+void replay_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) { fprintf(stderr, "%s: ", path); perror("No se puede abrir la traza"); exit(1); }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size == 0) { fprintf(stderr, "%s: traza vacía\n", path); exit(1); }
+    replay.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (replay.map == MAP_FAILED) { perror("mmap"); exit(1); }
+    replay.size = st.st_size;
+    madvise((void *)replay.map, replay.size, MADV_SEQUENTIAL);
+
+    const TraceHeader *h = (const TraceHeader *)replay.map;
+    if (replay.size >= sizeof(TraceHeader) && memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) == 0) {
+        if (h->record_size != sizeof(TraceRecord)) { fprintf(stderr, "%s: versión de traza no soportada\n", path); exit(1); }
+        replay.binary = 1;
+        replay.recs = (const TraceRecord *)(replay.map + sizeof(TraceHeader));
+        replay.n_recs = (replay.size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+        replay.n_ports = h->n_ports ? h->n_ports : 1;
+        // Con varios shards los bloques se intercalan y el primer registro
+        // no es necesariamente el más antiguo; la cabecera da el origen sin
+        // tener que recorrer la traza
+        replay.t_base = h->start_ns;
+        replay.timed = replay.speed > 0;
+    }
+}
+
+// Deja replay_pos en el próximo registro/línea válida para la balanza
+void replay_seek(Scale *s) {
+    if (replay.binary) {
+        while (s->replay_pos < replay.n_recs && replay.recs[s->replay_pos].port != s->replay_port) s->replay_pos++;
+        if (s->replay_pos < replay.n_recs) return;
+    } else {
+        int32_t d;
+        uint8_t st;
+        while (s->replay_pos < replay.size) {
+            const char *line = replay.map + s->replay_pos;
+            const char *nl = memchr(line, '\n', replay.size - s->replay_pos);
+            const char *end = nl ? nl : replay.map + replay.size;
+            if (parse_frame_text(line, end, &d, &st)) return;
+            s->replay_pos = end - replay.map + 1;
+        }
     }
+    if (!s->replay_done) {
+        s->replay_done = 1;
+        log_msg(LOG_EVENT, "[%s] Fin de la traza\n", s->device);
+        if (__atomic_sub_fetch(&replay.active_scales, 1, __ATOMIC_ACQ_REL) == 0) request_stop();
+    }
+}
+
+// Toma el valor de la posición actual y avanza a la siguiente
+void replay_value(Scale *s) {
+    if (s->replay_done) return;
+    if (replay.binary) {
+        const TraceRecord *r = &replay.recs[s->replay_pos++];
+        s->decimas = r->decimas;
+        s->status = r->status % 3;
+    } else {
+        const char *line = replay.map + s->replay_pos;
+        const char *nl = memchr(line, '\n', replay.size - s->replay_pos);
+        const char *end = nl ? nl : replay.map + replay.size;
+        parse_frame_text(line, end, &s->decimas, &s->status);
+        s->replay_pos = end - replay.map + 1;
+    }
+    replay_seek(s);
+}
+
+// Instante local en que sale el próximo registro de la traza
+static inline long long replay_due_ns(const Scale *s) {
+    return replay.start_ns + (long long)((replay.recs[s->replay_pos].t_ns - replay.t_base) / replay.speed);
+}
+
+void arm_oneshot(Scale *s, long long t_ns) {
+    struct itimerspec its = { .it_value = { t_ns / 1000000000LL, t_ns % 1000000000LL } };
+    if (t_ns <= 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(s->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int set_client_out(Client *c, int want) {
+    if (c->want_out == want) return 0;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0),
+                              .data.u64 = EV_TAG(EV_CLIENT, c - clients) };
+    c->want_out = want;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+void client_close(Client *c) {
+    NetOut *n = &scales[c->scale].net;
+    int idx = c - clients;
+    for (int *p = &n->clients; *p != -1; p = &clients[*p].next) {
+        if (*p == idx) {
+            *p = c->next;
+            break;
+        }
+    }
+    close(c->fd);
+    n->cut++;
+    c->scale = -1;
+    c->next = self->free_client;
+    self->free_client = idx;
+}
+
+// Envía al cliente lo pendiente de la historia, sin copiar: sendmsg apunta
+// directo al ring compartido (dos trozos si da la vuelta).
+void client_flush(Client *c) {
+    NetOut *n = &scales[c->scale].net;
+    while (c->pos < n->head) {
+        uint64_t lag = n->head - c->pos;
+        size_t off = c->pos % NET_RING;
+        size_t first = lag < NET_RING - off ? lag : NET_RING - off;
+        struct iovec iov[2] = { { n->ring + off, first }, { n->ring, lag - first } };
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = lag > first ? 2 : 1 };
+        ssize_t w = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                set_client_out(c, 1);
+                return;
+            }
+            client_close(c);
+            return;
+        }
+        c->pos += w;
+    }
+    set_client_out(c, 0);
+}
+
+// Publica una trama a TCP y UDP. Un cliente que quedaría más atrás que la
+// historia se corta o salta a esta trama, nunca frena el bucle.
+void net_publish(Scale *s, const char *bytes, int len) {
+    NetOut *n = &s->net;
+    if (udp_fd >= 0) {
+        struct sockaddr_in to = cfg.udp_addr;
+        to.sin_port = htons(ntohs(cfg.udp_addr.sin_port) + (s - scales));
+        if (sendto(udp_fd, bytes, len, MSG_DONTWAIT, (struct sockaddr *)&to, sizeof(to)) < 0) n->udp_errors++;
+    }
+    if (!n->ring) return;
+
+    size_t off = n->head % NET_RING;
+    size_t first = (size_t)len < NET_RING - off ? (size_t)len : NET_RING - off;
+    memcpy(n->ring + off, bytes, first);
+    memcpy(n->ring, bytes + first, len - first);
+    n->last_frame = n->head;
+    n->head += len;
+
+    for (int i = n->clients; i != -1;) {
+        Client *c = &clients[i];
+        i = c->next;
+        if (n->head - c->pos > NET_RING) {
+            if (!cfg.tcp_skip) {
+                client_close(c);
+                continue;
+            }
+            n->skipped += n->last_frame - c->pos;
+            c->pos = n->last_frame;
+        }
+        if (!c->want_out) client_flush(c);
+    }
+}
+
+void net_accept(Scale *s) {
+    NetOut *n = &s->net;
+    for (;;) {
+        int fd = accept4(n->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        if (self->free_client == -1) {
+            close(fd);
+            continue;
+        }
+        // Buffer de envío chico: el atraso de un cliente lento se ve en la
+        // historia propia y se le aplica la política, en vez de acumular
+        // segundos de tramas viejas en el kernel.
+        int one = 1, sndbuf = NET_RING / 2;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        int idx = self->free_client;
+        Client *c = &clients[idx];
+        self->free_client = c->next;
+        c->fd = fd;
+        c->scale = s - scales;
+        c->pos = n->head;          // empieza con la próxima trama completa
+        c->want_out = 0;
+        c->next = n->clients;
+        n->clients = idx;
+        n->accepted++;
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u64 = EV_TAG(EV_CLIENT, idx) };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Los clientes no envían nada: lo que llegue se descarta y un cierre libera la ranura
+void client_event(Client *c, uint32_t events) {
+    if (c->scale < 0) return;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        char buf[256];
+        ssize_t r = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+            client_close(c);
+            return;
+        }
+    }
+    if (events & EPOLLOUT) client_flush(c);
+}
+
+void setup_net(Scale *s, int idx) {
+    NetOut *n = &s->net;
+    n->clients = -1;
+    n->listen_fd = -1;
+    if (!cfg.tcp_port) return;
+
+    n->ring = malloc(NET_RING);
+    n->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(n->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(cfg.tcp_port + idx),
+                                .sin_addr.s_addr = htonl(INADDR_ANY) };
+    if (bind(n->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(n->listen_fd, 1024) == -1) {
+        fprintf(stderr, "TCP %d: ", cfg.tcp_port + idx);
+        perror("No se puede escuchar");
+        exit(1);
+    }
+}
+
+void shm_setup(void) {
+    int fd = shm_open(cfg.shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) { fprintf(stderr, "%s: ", cfg.shm_name); perror("shm_open"); exit(1); }
+    shm_size = sizeof(BalanzaShmHeader) + (size_t)n_scales * sizeof(BalanzaShmSlot);
+    if (ftruncate(fd, shm_size) == -1) { perror("ftruncate"); exit(1); }
+    void *map = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { perror("mmap"); exit(1); }
+
+    BalanzaShmHeader *h = map;
+    shm_slots = (BalanzaShmSlot *)((char *)map + sizeof(BalanzaShmHeader));
+    for (int i = 0; i < n_scales; i++)
+        snprintf(shm_slots[i].device, sizeof(shm_slots[i].device), "%s", scales[i].device);
+    h->n_scales = n_scales;
+    h->slot_size = sizeof(BalanzaShmSlot);
+    h->version = BALANZA_SHM_VERSION;
+    __atomic_store_n(&h->magic, BALANZA_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Publica el estado actual de la balanza en su ranura del seqlock
+static inline void shm_update(const Scale *s) {
+    BalanzaShmValue v = { .decimas = s->decimas, .status = s->status, .paused = s->paused,
+                          .frames = s->produced, .t_ns = s->deadline_ns };
+    balanza_shm_write(&shm_slots[s - scales], &v);
+}
+
+// Modelo físico: cada balanza es un sistema de segundo orden que sigue a la
+// carga puesta en el plato, con vibración y fluencia (creep). El estado vive
+// en un arreglo por campo (SoA) y avanza para todas las balanzas a la vez con
+// un paso fijo, en un bucle sin ramas que el compilador vectoriza. Las
+// tramas muestrean el estado en su plazo.
+typedef struct {
+    float x[MAX_SCALES];       // posición del plato, kg
+    float v[MAX_SCALES];       // velocidad, kg/s
+    float load[MAX_SCALES];    // carga puesta, kg
+    float creep[MAX_SCALES];   // fluencia acumulada, kg
+    float noise[MAX_SCALES];   // vibración del paso actual, kg
+    float limit[MAX_SCALES];   // sobrecarga (OL) desde este valor absoluto, kg
+    int32_t hold[MAX_SCALES];  // pasos hasta el próximo cambio de carga
+    int32_t decimas[MAX_SCALES];
+    uint8_t status[MAX_SCALES];
+    int n;
+    long long t0_ns, dt_ns;
+    float dt, w2, damp, inv_wn, creep_rate, noise_scale;
+} __attribute__((aligned(64))) Physics;
+
+Physics phys;
+
+// Pone o quita carga: la mitad de las veces vacía el plato si hay algo,
+// si no agrega entre 10 y 500 pasos de peso.
+void physics_event(Physics *p, int i, Rng *rng) {
+    if (p->load[i] != 0.0f && rng_double(rng) < 0.5) {
+        p->load[i] = 0.0f;
+    } else {
+        double kg = scales[i].step_d / 10.0 * (10.0 + 490.0 * rng_double(rng));
+        p->load[i] += roundf(kg * 10.0) / 10.0f;
+    }
+    p->hold[i] = (int32_t)(cfg.phys_hold * 1e9 / p->dt_ns * (0.5 + rng_double(rng))) + 1;
+}
+
+// Con -O2 gcc sólo vectoriza bucles de largo conocido: aquí se pide el
+// modelo de costo completo para el bucle principal.
+__attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+void physics_step(Physics *p, int first, int n, Rng *rng) {
+    int end = first + n;
+    for (int i = first; i < end; i += 2) {
+        uint64_t r = rng_next(rng);
+        p->noise[i] = (int32_t)(uint32_t)r * p->noise_scale;
+        if (i + 1 < end) p->noise[i + 1] = (int32_t)(uint32_t)(r >> 32) * p->noise_scale;
+    }
+
+    const float dt = p->dt, w2 = p->w2, damp = p->damp, inv_wn = p->inv_wn;
+    const float kc = p->creep_rate, cmax = cfg.phys_creep, tol = cfg.phys_tol;
+    for (int i = first; i < end; i++) {
+        float load = p->load[i];
+        float v = p->v[i] + dt * (w2 * (load - p->x[i]) - damp * p->v[i]);
+        float x = p->x[i] + dt * v;
+        float creep = p->creep[i] + kc * (cmax * load - p->creep[i]);
+        float shown = x + creep + p->noise[i];
+        p->v[i] = v;
+        p->x[i] = x;
+        p->creep[i] = creep;
+        p->decimas[i] = (int32_t)(shown * 10.0f + copysignf(0.5f, shown));
+        int unstable = fabsf(load - x) + fabsf(v) * inv_wn > tol;
+        int over = fabsf(shown) >= p->limit[i];
+        p->status[i] = (uint8_t)((unstable & ~over) * STATUS_US | over * STATUS_OL);
+        p->hold[i]--;
+    }
+
+    for (int i = first; i < end; i++)
+        if (p->hold[i] <= 0) physics_event(p, i, rng);
+}
+
+// Corre los pasos que faltan hasta t_ns para las balanzas del shard
+void physics_advance(long long t_ns) {
+    Shard *sh = self;
+    long long due = (t_ns - phys.t0_ns) / phys.dt_ns;
+    if (due - sh->phys_steps > PHYS_MAX_STEPS) sh->phys_steps = due - PHYS_MAX_STEPS;
+    for (; sh->phys_steps < due; sh->phys_steps++) physics_step(&phys, sh->first, sh->count, &sh->phys_rng);
+}
+
+// Arranca cada plato quieto y estable en su peso inicial. El reloj y el
+// generador de cada shard se inician con el shard.
+void physics_init(int n) {
+    Physics *p = &phys;
+    p->n = n;
+    p->dt_ns = cfg.period_ns < PHYS_MAX_DT_NS ? cfg.period_ns : PHYS_MAX_DT_NS;
+    p->dt = p->dt_ns / 1e9f;
+    double wn = 2.0 * M_PI * cfg.phys_freq;
+    p->w2 = wn * wn;
+    p->damp = 2.0 * cfg.phys_damping * wn;
+    p->inv_wn = 1.0 / wn;
+    p->creep_rate = p->dt / cfg.phys_creep_tau;
+    p->noise_scale = cfg.phys_noise / 2147483648.0;
+    Rng rng;
+    rng_seed(&rng, seed, MAX_SCALES);
+    for (int i = 0; i < n; i++) {
+        p->x[i] = p->load[i] = scales[i].decimas / 10.0f;
+        p->v[i] = p->creep[i] = 0.0f;
+        p->limit[i] = scales[i].limit_d / 10.0f;
+        p->decimas[i] = scales[i].decimas;
+        p->status[i] = STATUS_ST;
+        p->hold[i] = (int32_t)(cfg.phys_hold * 1e9 / p->dt_ns * rng_double(&rng)) + 1;
+    }
+    p->t0_ns = now_ns();
+}
+
+void physics_sample(Scale *s) {
+    physics_advance(s->deadline_ns);
+    s->decimas = phys.decimas[s - scales];
+    s->status = phys.status[s - scales];
+}
+
+void physics_set_load(Scale *s, int32_t decimas) { phys.load[s - scales] = decimas / 10.0f; }
+
+// Rampa original: paso entero + decimal aleatorio ±0.9, todo en décimas
+void ramp_sample(Scale *s) {
+    int32_t decimal_rand = next_step(s);
+    s->decimas += s->step_d + decimal_rand;
+
+    if (abs(s->decimas) >= s->limit_d) {
+        s->decimas = s->reset_d;
+        s->resets_auto++;
+    }
+}
+
+void ramp_set_load(Scale *s, int32_t decimas) { s->decimas = decimas; }
+
+// Modelos de peso seleccionables con --modelo
+typedef struct {
+    const char *name;
+    void (*init)(int n);
+    void (*sample)(Scale *s);             // avanza y deja decimas/status en la balanza
+    void (*set_load)(Scale *s, int32_t decimas);
+} WeightModel;
+
+const WeightModel models[] = {
+    { "rampa",  NULL,         ramp_sample,    ramp_set_load },
+    { "fisico", physics_init, physics_sample, physics_set_load },
+};
+const WeightModel *model = &models[0];
+#define N_MODELS (sizeof(models) / sizeof(models[0]))
+
+static inline unsigned int outq_count(const Scale *s) { return s->q_tail - s->q_head; }
+
+void set_want_out(Scale *s, int want) {
+    if (s->want_out == want) return;
+    struct epoll_event ev = { .events = want ? EPOLLOUT : 0, .data.u64 = EV_TAG(EV_PORT, s - scales) };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    self->syscalls++;
+    s->want_out = want;
+}
+
+// Errores de escritura que no se arreglan reintentando
+static inline int port_gone(int err) { return err == EIO || err == ENXIO || err == ENODEV || err == EPIPE; }
+
+// El dispositivo desapareció (EIO, EPOLLHUP): se saca del epoll, que si no
+// lo seguiría informando en cada vuelta, y la balanza sigue generando para
+// la red pero descarta su salida serie
+void port_dead(Scale *s, int err) {
+    if (s->dead) return;
+    s->dead = 1;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    self->syscalls++;
+    s->want_out = 0;
+    log_msg(LOG_ALWAYS, "[%s] Puerto perdido (%s): no se escribe más\n", s->device,
+            err ? strerror(err) : "colgó");
+}
+
+// Tramas de la cola que se pueden escribir: una reordenada espera a la siguiente
+static inline unsigned int outq_pending(const Scale *s) { return s->q_tail - s->q_head - s->held; }
+
+// --fallas: decide cómo sale al cable la trama k, la última de la cola. La
+// plantilla no se toca: corromper, truncar, quitar el fin de línea, meter
+// ruido y duplicar quedan anotados en la meta y fault_pieces los arma como
+// iovec sobre la trama y fault_noise al escribir.
+void fault_pick(Scale *s, unsigned int k) {
+    Frame *f = &s->outq[k % OUTQ_SLOTS];
+    FrameMeta *m = &s->outq_meta[k % OUTQ_SLOTS];
+    m->fault = FAULT_NONE;
+    if (s->held) {
+        // La trama retenida sale detrás de ésta
+        Frame tf = *f;
+        FrameMeta tm = *m;
+        *f = s->outq[(k - 1) % OUTQ_SLOTS];
+        *m = s->outq_meta[(k - 1) % OUTQ_SLOTS];
+        s->outq[(k - 1) % OUTQ_SLOTS] = tf;
+        s->outq_meta[(k - 1) % OUTQ_SLOTS] = tm;
+        s->held = 0;
+        return;
+    }
+
+    double u = rng_double(&s->fault_rng);
+    int kind = FAULT_CORRUPT;
+    for (; kind < N_FAULTS && u >= cfg.fault_p[kind]; kind++) u -= cfg.fault_p[kind];
+    if (kind == N_FAULTS) return;
+    uint64_t r = rng_next(&s->fault_rng);
+    switch (kind) {
+    case FAULT_CORRUPT:
+        // Un byte antes del fin de línea, cambiado por otro distinto
+        m->fault_pos = r % (f->len > 2 ? f->len - 2 : 1);
+        m->fault_arg = (r >> 8) % FAULT_NOISE;
+        if (fault_noise[m->fault_arg] == (uint8_t)f->bytes[m->fault_pos]) m->fault_arg++;
+        break;
+    case FAULT_TRUNCATE:
+        m->fault_pos = 1 + r % (f->len - 1);
+        break;
+    case FAULT_NO_CRLF:
+        m->fault_pos = f->len - (f->len >= 2 && f->bytes[f->len - 2] == '\r' ? 2 : 1);
+        break;
+    case FAULT_NOISE_BEFORE:
+        m->fault_pos = 1 + r % FAULT_NOISE_MAX;
+        m->fault_arg = (r >> 8) % (FAULT_NOISE - FAULT_NOISE_MAX);
+        break;
+    case FAULT_REORDER:
+        s->held = 1;
+        break;
+    case FAULT_STALL:
+        s->stall_until = s->deadline_ns + (long long)(rng_double(&s->fault_rng) * FAULT_STALL_MAX_NS);
+        break;
+    }
+    m->fault = kind;
+    s->faults[kind]++;
+}
+
+// Piezas de la trama k tal como sale al cable; sin falla es una sola
+static inline unsigned int fault_pieces(Scale *s, unsigned int k, struct iovec *iov) {
+    Frame *f = &s->outq[k % OUTQ_SLOTS];
+    const FrameMeta *m = &s->outq_meta[k % OUTQ_SLOTS];
+    iov[0].iov_base = f->bytes;
+    iov[0].iov_len = f->len;
+    switch (m->fault) {
+    case FAULT_CORRUPT:
+        iov[0].iov_len = m->fault_pos;
+        iov[1].iov_base = &fault_noise[m->fault_arg];
+        iov[1].iov_len = 1;
+        iov[2].iov_base = f->bytes + m->fault_pos + 1;
+        iov[2].iov_len = f->len - m->fault_pos - 1;
+        return 3;
+    case FAULT_TRUNCATE:
+    case FAULT_NO_CRLF:
+        iov[0].iov_len = m->fault_pos;
+        return 1;
+    case FAULT_NOISE_BEFORE:
+        iov[1] = iov[0];
+        iov[0].iov_base = &fault_noise[m->fault_arg];
+        iov[0].iov_len = m->fault_pos;
+        return 2;
+    case FAULT_DUPLICATE:
+        iov[1] = iov[0];
+        return 2;
+    }
+    return 1;
+}
+
+// Bytes que ocupa en el cable la trama k
+static inline size_t frame_wire_len(const Scale *s, unsigned int k) {
+    const FrameMeta *m = &s->outq_meta[k % OUTQ_SLOTS];
+    size_t len = s->outq[k % OUTQ_SLOTS].len;
+    switch (m->fault) {
+    case FAULT_TRUNCATE:
+    case FAULT_NO_CRLF:      return m->fault_pos;
+    case FAULT_NOISE_BEFORE: return len + m->fault_pos;
+    case FAULT_DUPLICATE:    return 2 * len;
+    }
+    return len;
+}
+
+// Puerto detenido por una falla "detener"
+static inline int port_stalled(Scale *s) {
+    if (!s->stall_until) return 0;
+    if (now_ns() < s->stall_until) return 1;
+    s->stall_until = 0;
+    return 0;
+}
+
+// Codifica en la ranura k el valor actual de la balanza
+static inline void render_frame(Scale *s, unsigned int k) {
+    // Tras una recarga que cambió el protocolo cada ranura se rearma la
+    // próxima vez que se usa, sin tocar las que están en vuelo
+    Frame *f = &s->outq[k % OUTQ_SLOTS];
+    if (f->proto != s->proto) {
+        protocols[s->proto].init(f);
+        f->proto = s->proto;
+    }
+    protocols[s->proto].encode(f, s->decimas, s->tare, s->status);
+    FrameMeta *m = &s->outq_meta[k % OUTQ_SLOTS];
+    m->decimas = s->decimas;
+    m->status = s->status;
+}
+
+// Avanza la simulación y codifica la trama directamente en la cola. Si
+// hay una adelantada sólo se toma: el peso mostrado pasa a ser el suyo.
+void produce_frame(Scale *s) {
+    Frame *f = &s->outq[s->q_tail % OUTQ_SLOTS];
+    FrameMeta *m = &s->outq_meta[s->q_tail % OUTQ_SLOTS];
+    if (s->ready) {
+        s->ready--;
+        s->decimas = m->decimas;
+        s->status = m->status;
+    } else {
+        if (replay.map) replay_value(s);
+        else models[s->model].sample(s);
+        render_frame(s, s->q_tail);
+    }
+    int len = f->len;
+    m->deadline_ns = s->deadline_ns;
+    s->q_tail++;
+    if (cfg.faults) fault_pick(s, s->q_tail - 1);
+    if (s->net.ring || udp_fd >= 0) net_publish(s, f->bytes, len);
+
+    s->produced++;
+    if (shm_slots) shm_update(s);
+    if (cfg.echo_mode == ECHO_ALL || (cfg.echo_mode == ECHO_SAMPLED && s->produced % cfg.echo_every == 0)) {
+        if (n_scales > 1) log_msg(LOG_FRAME, "[%s] Enviado: %.*s", s->device, len, f->bytes);
+        else log_msg(LOG_FRAME, "Enviado: %.*s", len, f->bytes);
+    }
+}
+
+// --adelanto: la rampa no depende del reloj, así que las próximas tramas
+// se pueden generar y codificar fuera del plazo, en las ranuras libres
+// detrás de q_tail. El plazo siguiente sólo las toma (produce_frame).
+// Las adelantadas ocupan lugar en la cola: outq_count + ready nunca pasa
+// de OUTQ_SLOTS, y la política de desborde actúa sólo con ready = 0.
+static inline int lookahead_on(const Scale *s) { return cfg.lookahead && s->model == 0 && !replay.map; }
+
+void lookahead_fill(Scale *s) {
+    if (!lookahead_on(s)) return;
+    int32_t shown = s->decimas;
+    if (s->ready) s->decimas = s->ahead_d;
+    while (s->ready < cfg.lookahead && outq_count(s) + s->ready < OUTQ_SLOTS) {
+        ramp_sample(s);
+        render_frame(s, s->q_tail + s->ready);
+        s->ready++;
+    }
+    s->ahead_d = s->decimas;
+    s->decimas = shown;
+}
+
+// Las tramas adelantadas dejan de valer: con otra carga se descartan (la
+// rampa sigue desde el peso nuevo) y con otra tara se recodifican.
+void lookahead_invalidate(Scale *s, int retare) {
+    if (!retare) {
+        s->ready = 0;
+        return;
+    }
+    for (int k = 0; k < s->ready; k++) {
+        unsigned int q = s->q_tail + k;
+        FrameMeta *m = &s->outq_meta[q % OUTQ_SLOTS];
+        protocols[s->proto].encode(&s->outq[q % OUTQ_SLOTS], m->decimas, s->tare, m->status);
+    }
+}
+
+// Un plazo cumplido: aplica la política de desborde si la cola está llena
+void send_frame(Scale *s) {
+    if (outq_count(s) == OUTQ_SLOTS) {
+        if (s->dropped == 0 && s->delayed == 0)
+            log_msg(LOG_EVENT, "[%s] Cola de salida llena: el enlace no da abasto\n", s->device);
+        switch (cfg.overflow_policy) {
+        case OVERFLOW_DROP_NEWEST:
+            s->dropped++;
+            return;
+        case OVERFLOW_STALL:
+            s->stalled++;
+            s->delayed++;
+            return;
+        case OVERFLOW_DROP_OLDEST:
+            s->dropped++;
+            if (s->inflight) {
+                // Las tramas en vuelo no se tocan: se descarta la más vieja
+                // de las que esperan y las siguientes se corren un lugar
+                unsigned int d = s->q_head + s->inflight;
+                if (d == s->q_tail) return;
+                for (; d + 1 != s->q_tail; d++) {
+                    s->outq[d % OUTQ_SLOTS] = s->outq[(d + 1) % OUTQ_SLOTS];
+                    s->outq_meta[d % OUTQ_SLOTS] = s->outq_meta[(d + 1) % OUTQ_SLOTS];
+                }
+                s->q_tail--;
+                break;
+            }
+            if (s->q_off > 0) {
+                // la más vieja ya salió a medias: se descarta la siguiente
+                s->outq[(s->q_head + 1) % OUTQ_SLOTS] = s->outq[s->q_head % OUTQ_SLOTS];
+                s->outq_meta[(s->q_head + 1) % OUTQ_SLOTS] = s->outq_meta[s->q_head % OUTQ_SLOTS];
+            }
+            s->q_head++;
+            break;
+        }
+    }
+    produce_frame(s);
+}
+
+// Arma el iovec con las tramas pendientes, la primera desde q_off
+unsigned int output_iov(Scale *s, struct iovec *iov) {
+    unsigned int frames = outq_pending(s), n = 0;
+    for (unsigned int k = 0; k < frames; k++) n += fault_pieces(s, s->q_head + k, iov + n);
+
+    // q_off cuenta bytes en el cable: con fallas puede pasar de una pieza
+    unsigned int skip = 0;
+    size_t off = s->q_off;
+    while (off > 0 && off >= iov[skip].iov_len) off -= iov[skip++].iov_len;
+    iov[skip].iov_base = (char *)iov[skip].iov_base + off;
+    iov[skip].iov_len -= off;
+    if (skip) memmove(iov, iov + skip, (n - skip) * sizeof(*iov));
+    return n - skip;
+}
+
+// Avanza la cola por los w bytes escritos de iov y genera las tramas
+// retenidas si quedó lugar. Devuelve 1 si la escritura quedó corta.
+int output_written(Scale *s, const struct iovec *iov, unsigned int n, size_t w, long long t_start, long long t_end) {
+    size_t total = 0;
+    for (unsigned int k = 0; k < n; k++) total += iov[k].iov_len;
+    int partial = w < total;
+    if (partial) s->short_writes++;
+    s->kq_bound += w;
+    // Los vacía el shard dueño: sus contadores no son atómicos
+    unsigned int gen = __atomic_load_n(&hist_generation, __ATOMIC_RELAXED);
+    if (s->hist_gen != gen) {
+        memset(&s->jitter, 0, sizeof(s->jitter));
+        memset(&s->write_lat, 0, sizeof(s->write_lat));
+        s->hist_gen = gen;
+    }
+    s->bytes += w;
+
+    // Avanzar la cabeza por las tramas completas escritas
+    while (w > 0) {
+        size_t rest = frame_wire_len(s, s->q_head) - s->q_off;
+        if (w < rest) {
+            s->q_off += w;
+            break;
+        }
+        w -= rest;
+        FrameMeta *m = &s->outq_meta[s->q_head % OUTQ_SLOTS];
+        hist_record(&s->jitter, t_start - m->deadline_ns);
+        hist_record(&s->write_lat, t_end - t_start);
+        // Inicio de la escritura: en un PTY el lector puede tener la trama
+        // antes de que writev vuelva
+        if (self->recorder) recorder_add(self->recorder, t_start, s - scales, m, m->fault ? TRACE_FAULT : 0);
+        s->q_head++;
+        s->q_off = 0;
+        s->frames++;
+    }
+
+    // Con espacio libre se generan las tramas retenidas
+    while (s->stalled > 0 && outq_count(s) < OUTQ_SLOTS) {
+        produce_frame(s);
+        s->stalled--;
+    }
+    return partial;
+}
+
+// La cola del tty (port_queued) no puede haber crecido más que lo que
+// escribimos desde la última consulta: mientras esa cota esté bajo
+// outq_limit no hace falta el ioctl. Con la cola llena se reintenta en el
+// próximo plazo: EPOLLOUT avisaría de inmediato, porque el kernel todavía
+// tiene lugar, y el bucle giraría en vacío.
+static inline int port_full(Scale *s) {
+    if (s->kq_bound < cfg.outq_limit) return 0;
+    s->kq_bound = port_queued(s);
+    self->syscalls++;
+    return s->kq_bound >= cfg.outq_limit;
+}
+
+void uring_flush(Scale *s);
+
+// Escribe con un solo writev todas las tramas pendientes que quepan.
+// No escribe mientras la cola del tty (port_queued) supere outq_limit, así
+// un enlace lento se nota en la cola propia en vez de esconder latencia
+// en el buffer del kernel.
+void flush_output(Scale *s) {
+    if (s->dead) {
+        s->dropped += outq_count(s);
+        s->q_head = s->q_tail;
+        s->q_off = 0;
+        s->held = 0;
+        return;
+    }
+    if (self->ring) {
+        uring_flush(s);
+        return;
+    }
+    // Durante una detención EPOLLOUT seguiría disparando con el puerto
+    // libre; la cola se retoma en el primer plazo tras stall_until
+    if (port_stalled(s)) {
+        set_want_out(s, 0);
+        return;
+    }
+    while (outq_pending(s) > 0) {
+        if (port_full(s)) {
+            set_want_out(s, 0);
+            return;
+        }
+
+        struct iovec iov[OUTQ_IOV];
+        unsigned int n = output_iov(s, iov);
+        long long t_start = now_ns();
+        ssize_t w = writev(s->fd, iov, n);
+        long long t_end = now_ns();
+        self->syscalls++;
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                set_want_out(s, 1);
+                return;
+            }
+            // Otro error: se cuenta y se reintenta en el próximo plazo
+            s->write_errors++;
+            if (port_gone(errno)) port_dead(s, errno);
+            else set_want_out(s, 0);
+            return;
+        }
+        if (output_written(s, iov, n, w, t_start, t_end)) {
+            set_want_out(s, 1);
+            return;
+        }
+    }
+    set_want_out(s, 0);
+}
+
+Uring *uring_open(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Un solo hilo envía en cada anillo; núcleos anteriores a 6.0 no
+    // conocen el flag y se reintenta sin él
+    p.flags = IORING_SETUP_SINGLE_ISSUER;
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (fd < 0) return NULL;
+
+    Uring *r = calloc(1, sizeof(Uring));
+    r->fd = fd;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cq_map = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq_map
+              : mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(fd);
+        free(r);
+        return NULL;
+    }
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    return r;
+}
+
+void uring_close(Uring *r) {
+    munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_size);
+    munmap(r->sq_map, r->sq_size);
+    close(r->fd);
+    free(r);
+}
+
+// Envía todo lo preparado con un solo io_uring_enter
+void uring_submit(Uring *r) {
+    while (r->pending) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 0, 0, NULL, 0);
+        self->syscalls++;
+        r->enters++;
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("io_uring_enter");
+            exit(1);
+        }
+        r->pending -= ret;
+    }
+}
+
+// Respuesta de la escritura en curso de una balanza
+void uring_done(Scale *s, int res) {
+    long long t_end = now_ns();
+    s->inflight = 0;
+    if (res < 0) {
+        if (res == -EAGAIN || res == -EINTR) {
+            set_want_out(s, 1);
+            return;
+        }
+        s->write_errors++;
+        if (port_gone(-res)) port_dead(s, -res);
+        else set_want_out(s, 0);
+        return;
+    }
+    output_written(s, s->wiov, s->wiov_n, res, s->w_start, t_end);
+    uring_flush(s);
+}
+
+// Lee las respuestas disponibles; no hace falta llamar al kernel
+void uring_reap(Uring *r) {
+    unsigned head = *r->cq_head;
+    for (;;) {
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+        const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        Scale *s = &scales[cqe->user_data];
+        int res = cqe->res;
+        __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+        uring_done(s, res);
+    }
+}
+
+// Fin de una vuelta del bucle: envía lo preparado y procesa lo que ya
+// terminó (las escrituras a un tty con espacio se completan en el mismo
+// io_uring_enter), que puede preparar más.
+void uring_run(Uring *r) {
+    while (r->pending) {
+        uring_submit(r);
+        uring_reap(r);
+    }
+}
+
+// Prepara un writev de todas las tramas pendientes; a lo sumo uno en vuelo
+// por balanza, así los iovec y las ranuras escritas no cambian hasta la
+// respuesta.
+void uring_flush(Scale *s) {
+    if (s->dead || s->inflight || outq_pending(s) == 0) return;
+    set_want_out(s, 0);
+    if (port_stalled(s) || port_full(s)) return;
+
+    Uring *r = self->ring;
+    if (r->pending == r->sq_entries) uring_submit(r);
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    unsigned int n = output_iov(s, s->wiov);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = s->fd;
+    sqe->addr = (uint64_t)(uintptr_t)s->wiov;
+    sqe->len = n;
+    sqe->off = (uint64_t)-1;   // posición actual: los tty no tienen offset
+    sqe->user_data = s - scales;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    r->writes++;
+    s->inflight = outq_pending(s);
+    s->wiov_n = n;
+    s->w_start = now_ns();
+}
+
+// Mensaje de evento con color: msg lleva el peso y el sufijo
+void log_colored(const char *color, const char *msg, const char *numbuf) {
+    char text[LOG_LINE];
+    int len = snprintf(text, sizeof(text), "%s", color);
+    len += snprintf(text + len, sizeof(text) - len, msg, numbuf, cfg.suffix);
+    if (len < LOG_LINE) len += snprintf(text + len, sizeof(text) - len, "%s", cfg.color_reset_all);
+    log_write(LOG_EVENT, text, len < LOG_LINE ? len : LOG_LINE - 1);
+}
+
+static inline Shard *shard_of(int scale) {
+    int k = (long long)scale * n_shards / n_scales;
+    while (scale < shards[k].first) k--;
+    while (scale >= shards[k].first + shards[k].count) k++;
+    return &shards[k];
+}
+
+// Encola un comando para el shard y lo despierta. Sólo lo llama el hilo
+// principal; devuelve -1 si la cola está llena.
+int shard_send(Shard *sh, int op, int scale, int64_t value) {
+    unsigned int tail = sh->cmds.tail;
+    if (tail - __atomic_load_n(&sh->cmds.head, __ATOMIC_ACQUIRE) == CMD_SLOTS) return -1;
+    sh->cmds.slots[tail % CMD_SLOTS] = (Command){ op, scale, value };
+    __atomic_store_n(&sh->cmds.tail, tail + 1, __ATOMIC_RELEASE);
+    eventfd_write(sh->cmd_fd, 1);
+    return 0;
+}
+
+int broadcast_command(int op, int64_t value) {
+    int err = 0;
+    for (int k = 0; k < n_shards; k++) err |= shard_send(&shards[k], op, -1, value);
+    return err;
+}
+
+// Teclado: pausa y reset se aplican a todas las balanzas
+void handle_key(char c) {
+    char numbuf[64];
+    format_num(scales[0].decimas / 10.0, numbuf, cfg.num_width);
+
+    if (c == cfg.reset_key) {
+        broadcast_command(CMD_RESET, 0);
+        format_num(cfg.reset_value, numbuf, cfg.num_width);
+        log_colored(cfg.color_reset, cfg.msg_reset, numbuf);
+    } else if (c == cfg.pause_key || c == toupper(cfg.pause_key)) {
+        cfg.paused = !cfg.paused;
+        broadcast_command(cfg.paused ? CMD_PAUSE : CMD_RESUME, 0);
+        if (cfg.paused) {
+            log_colored(cfg.color_pause, cfg.msg_pause, numbuf);
+        } else {
+            log_colored(cfg.color_resume, cfg.msg_resume, numbuf);
+        }
+    }
+}
+
+void set_rate(Scale *s, long long period_ns) {
+    if (cfg.cap_to_line && period_ns < s->line_ns) period_ns = s->line_ns;
+    s->period_ns = period_ns;
+    if (!replay.timed) arm_periodic(s, now_ns() + period_ns);
+}
+
+// Comando ya dirigido a una balanza; lo ejecuta el shard que la atiende
+void apply_command(Scale *s, int op, int64_t value) {
+    switch (op) {
+    case CMD_PAUSE:  s->paused = 1; break;
+    case CMD_RESUME: s->paused = 0; break;
+    case CMD_LOAD:   models[s->model].set_load(s, (int32_t)value); break;
+    case CMD_TARE:   s->tare = (int32_t)value; break;
+    case CMD_RATE:   set_rate(s, value); break;
+    case CMD_RESET:
+        models[s->model].set_load(s, s->reset_d);
+        s->resets_manual++;
+        break;
+    }
+    if (s->ready && (op == CMD_LOAD || op == CMD_TARE || op == CMD_RESET)) lookahead_invalidate(s, op == CMD_TARE);
+    if (shm_slots) shm_update(s);
+}
+
+// Formato del archivo, una clave por línea ("#" comenta el resto):
+//   frecuencia 10            paso 1            rango -50.3 543.5
+//   limite 1350.8            reinicio 0.0      protocolo nt      modelo rampa
+//   balanza /dev/ttyUSB0     agrega un puerto serie
+//   balanza pty 64           agrega 64 PTY (numerados con --pty-enlace)
+//   en 5s carga 120.5        evento: pausa, reanuda, reset, carga kg, tara kg,
+//   en 1m30s tasa 50                 tasa hz
+//   ciclo 2m                 repite los eventos del grupo
+// Las claves antes del primer "balanza" son los valores por defecto; las
+// que siguen a un "balanza" valen sólo para ese grupo. Sin líneas "balanza"
+// se usan los -d y --pty de la línea de comandos.
+const char *scenario_path;
+Scenario *scenario;
+const char **cli_devices;
+int cli_n_devices, cli_n_pty;
+unsigned int scenario_generation;
+
+// "90", "1.5s", "250ms", "2m", "1m30s" -> ns
+int parse_duration(const char *text, long long *ns) {
+    double total = 0;
+    const char *p = text;
+    do {
+        char *end;
+        double v = strtod(p, &end);
+        if (end == p || v < 0) return -1;
+        if (strncmp(end, "ms", 2) == 0) v /= 1e3, end += 2;
+        else if (*end == 's') end++;
+        else if (*end == 'm') v *= 60, end++;
+        else if (*end == 'h') v *= 3600, end++;
+        else if (*end) return -1;
+        total += v;
+        p = end;
+    } while (*p);
+    *ns = llround(total * 1e9);
+    return 0;
+}
+
+static int event_cmp(const void *a, const void *b) {
+    long long x = ((const ScenarioEvent *)a)->at_ns, y = ((const ScenarioEvent *)b)->at_ns;
+    return (x > y) - (x < y);
+}
+
+void scenario_free(Scenario *sc) {
+    if (!sc) return;
+    for (int i = 0; i < sc->n; i++) free((char *)sc->ports[i]);
+    free(sc->ports);
+    free(sc->params);
+    free(sc->events);
+    free(sc);
+}
+
+// Cierra el grupo que empezó en la balanza first: todas comparten p
+static void scenario_group(Scenario *sc, int first, const ScaleParams *p) {
+    qsort(sc->events + p->first_event, p->n_events, sizeof(ScenarioEvent), event_cmp);
+    for (int i = first; i < sc->n; i++) sc->params[i] = *p;
+}
+
+// Lee el archivo (o sólo los valores de la línea de comandos si path es
+// NULL). Devuelve NULL con el motivo en err; nunca deja nada a medias.
+Scenario *scenario_load(const char *path, char *err, size_t errlen) {
+    Scenario *sc = calloc(1, sizeof(Scenario));
+    sc->ports = calloc(MAX_SCALES, sizeof(char *));
+    sc->params = calloc(MAX_SCALES, sizeof(ScaleParams));
+    int cap_events = 0;
+
+    ScaleParams def = {
+        .period_ns = cfg.period_ns, .step_d = cfg.step_value * 10,
+        .limit_d = reset_limit_d, .reset_d = reset_value_d,
+        .start_min_d = (int32_t)llround(cfg.min_start * 10.0), .start_max_d = (int32_t)llround(cfg.max_start * 10.0),
+        .proto = proto - protocols, .model = model - models,
+    };
+    ScaleParams cur = def;
+    ScaleParams *p = &def;
+    int group_first = -1;
+    int lineno = 0;
+    FILE *f = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    err[0] = '\0';
+    if (path && !(f = fopen(path, "r"))) {
+        snprintf(err, errlen, "%s", strerror(errno));
+        goto fail;
+    }
+    while (f && getline(&line, &cap, f) > 0) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *save = NULL;
+        char *key = strtok_r(line, " \t\r\n", &save);
+        if (!key) continue;
+        char *a1 = strtok_r(NULL, " \t\r\n", &save);
+        char *a2 = strtok_r(NULL, " \t\r\n", &save);
+        char *a3 = strtok_r(NULL, " \t\r\n", &save);
+
+        if (strcmp(key, "balanza") == 0) {
+            if (group_first >= 0) scenario_group(sc, group_first, &cur);
+            int count = 1;
+            if (a1 && strcmp(a1, "pty") == 0) count = a2 ? atoi(a2) : 1;
+            if (!a1 || count < 1 || sc->n + count > MAX_SCALES) {
+                snprintf(err, errlen, "línea %d: balanza /dev/puerto | balanza pty N (máximo %d balanzas)", lineno,
+                         MAX_SCALES);
+                goto fail;
+            }
+            const char *port = strcmp(a1, "pty") == 0 ? NULL : strdup(a1);
+            group_first = sc->n;
+            for (int k = 0; k < count; k++) sc->ports[sc->n++] = port;
+            cur = def;
+            cur.first_event = sc->n_events;
+            cur.n_events = 0;
+            p = &cur;
+        } else if (strcmp(key, "en") == 0) {
+            long long at;
+            int op = -1;
+            for (int k = 0; a2 && k <= CMD_RESET; k++)
+                if (strcmp(a2, command_names[k]) == 0) op = k;
+            int needs_value = op == CMD_LOAD || op == CMD_TARE || op == CMD_RATE;
+            if (group_first < 0 || !a1 || parse_duration(a1, &at) != 0 || op < 0 || (needs_value && !a3)) {
+                snprintf(err, errlen, "línea %d: en <tiempo> pausa|reanuda|reset|carga kg|tara kg|tasa hz, "
+                         "después de una línea balanza", lineno);
+                goto fail;
+            }
+            int64_t value = 0;
+            if (op == CMD_LOAD || op == CMD_TARE) value = llround(atof(a3) * 10.0);
+            if (op == CMD_RATE) {
+                double hz = atof(a3);
+                if (hz <= 0) { snprintf(err, errlen, "línea %d: tasa mayor que 0 Hz", lineno); goto fail; }
+                value = llround(1e9 / hz);
+            }
+            if (sc->n_events == cap_events) {
+                cap_events = cap_events ? cap_events * 2 : 16;
+                sc->events = realloc(sc->events, cap_events * sizeof(ScenarioEvent));
+            }
+            sc->events[sc->n_events++] = (ScenarioEvent){ at, op, value };
+            cur.n_events++;
+        } else if (strcmp(key, "ciclo") == 0) {
+            if (group_first < 0 || !a1 || parse_duration(a1, &p->cycle_ns) != 0 || p->cycle_ns <= 0) {
+                snprintf(err, errlen, "línea %d: ciclo <tiempo>, después de una línea balanza", lineno);
+                goto fail;
+            }
+        } else if (!a1) {
+            snprintf(err, errlen, "línea %d: falta el valor de %s", lineno, key);
+            goto fail;
+        } else if (strcmp(key, "frecuencia") == 0) {
+            double hz = atof(a1);
+            if (hz <= 0 || 1e9 / hz < MIN_PERIOD_NS) {
+                snprintf(err, errlen, "línea %d: frecuencia entre 0 y %lld Hz", lineno, 1000000000LL / MIN_PERIOD_NS);
+                goto fail;
+            }
+            p->period_ns = llround(1e9 / hz);
+        } else if (strcmp(key, "paso") == 0) {
+            p->step_d = (int32_t)llround(atof(a1) * 10.0);
+            if (p->step_d < 1 || p->step_d > 100) {
+                snprintf(err, errlen, "línea %d: paso entre 0.1 y 10 kg", lineno);
+                goto fail;
+            }
+        } else if (strcmp(key, "limite") == 0) {
+            p->limit_d = (int32_t)llround(atof(a1) * 10.0);
+            if (p->limit_d <= 0) { snprintf(err, errlen, "línea %d: límite mayor que 0 kg", lineno); goto fail; }
+        } else if (strcmp(key, "reinicio") == 0) {
+            p->reset_d = (int32_t)llround(atof(a1) * 10.0);
+        } else if (strcmp(key, "rango") == 0 && a2) {
+            p->start_min_d = (int32_t)llround(atof(a1) * 10.0);
+            p->start_max_d = (int32_t)llround(atof(a2) * 10.0);
+        } else if (strcmp(key, "protocolo") == 0) {
+            int k = N_PROTOCOLS - 1;
+            while (k >= 0 && strcmp(a1, protocols[k].name) != 0) k--;
+            if (k < 0) { snprintf(err, errlen, "línea %d: protocolo desconocido: %s", lineno, a1); goto fail; }
+            p->proto = k;
+        } else if (strcmp(key, "modelo") == 0) {
+            int k = N_MODELS - 1;
+            while (k >= 0 && strcmp(a1, models[k].name) != 0) k--;
+            if (k < 0) { snprintf(err, errlen, "línea %d: modelo desconocido: %s", lineno, a1); goto fail; }
+            p->model = k;
+        } else {
+            snprintf(err, errlen, "línea %d: clave desconocida: %s", lineno, key);
+            goto fail;
+        }
+    }
+    if (group_first >= 0) {
+        scenario_group(sc, group_first, &cur);
+    } else {
+        // Sin grupos: los puertos de la línea de comandos con los valores del archivo
+        for (int i = 0; i < cli_n_devices + cli_n_pty; i++) {
+            sc->ports[sc->n] = i < cli_n_devices ? strdup(cli_devices[i]) : NULL;
+            sc->params[sc->n++] = def;
+        }
+    }
+
+    for (int i = 0; i < sc->n; i++) {
+        ScaleParams *q = &sc->params[i];
+        // Un ciclo no puede ser más corto que sus eventos
+        if (q->n_events && q->cycle_ns && q->cycle_ns <= sc->events[q->first_event + q->n_events - 1].at_ns) {
+            snprintf(err, errlen, "balanza %d: el ciclo termina antes del último evento", i);
+            goto fail;
+        }
+        // El límite de la línea depende del largo de la trama de cada protocolo
+        Frame probe;
+        protocols[q->proto].init(&probe);
+        q->line_ns = wire_time_ns(probe.fixed_len);
+        if (cfg.cap_to_line && q->period_ns < q->line_ns) q->period_ns = q->line_ns;
+        if (q->model == 1 && phys.dt_ns == 0 && scenario) {
+            snprintf(err, errlen, "balanza %d: el modelo físico no estaba activo, hay que reiniciar", i);
+            goto fail;
+        }
+    }
+    free(line);
+    if (f) fclose(f);
+    sc->generation = ++scenario_generation;
+    return sc;
+
+fail:
+    free(line);
+    if (f) fclose(f);
+    scenario_free(sc);
+    return NULL;
+}
+
+// Copia a la balanza su entrada del escenario. Al arrancar lo hace el hilo
+// principal antes de crear los shards; en una recarga, el shard de la
+// balanza (live = 1), que además rearma el timer si cambió la frecuencia.
+void scenario_apply(Scale *s, const Scenario *sc, long long now, int live) {
+    int i = s - scales;
+    const ScaleParams *p = &sc->params[i];
+    if (s->ready) lookahead_invalidate(s, 0);
+    s->step_d = p->step_d;
+    s->limit_d = p->limit_d;
+    s->reset_d = p->reset_d;
+    s->proto = p->proto;
+    s->line_ns = p->line_ns;
+    if (p->model != s->model && p->model == 1) {
+        // El plato arranca quieto en el peso que mostraba la rampa
+        phys.x[i] = phys.load[i] = s->decimas / 10.0f;
+        phys.v[i] = phys.creep[i] = 0.0f;
+    }
+    s->model = p->model;
+    phys.limit[i] = p->limit_d / 10.0f;
+    s->events = sc->events + p->first_event;
+    s->n_events = p->n_events;
+    s->next_event = 0;
+    s->events_t0 = now;
+    s->cycle_ns = p->cycle_ns;
+    s->event_due = s->n_events ? now + s->events[0].at_ns : LLONG_MAX;
+    if (!live) s->period_ns = p->period_ns;
+    else if (p->period_ns != s->period_ns) set_rate(s, p->period_ns);
+}
+
+// Eventos vencidos hasta el plazo actual. Devuelve 1 si alguno rearmó el
+// timer de la balanza.
+int scenario_events(Scale *s) {
+    long long t = s->start_ns + (long long)(s->tick - 1) * s->period_ns;
+    int rearmed = 0;
+    while (s->event_due <= t) {
+        const ScenarioEvent *e = &s->events[s->next_event++];
+        rearmed |= e->op == CMD_RATE;
+        apply_command(s, e->op, e->value);
+        log_msg(LOG_EVENT, "[%s] Escenario: %s\n", s->device, command_names[e->op]);
+        if (s->next_event == s->n_events) {
+            if (!s->cycle_ns) {
+                s->event_due = LLONG_MAX;
+                break;
+            }
+            s->next_event = 0;
+            s->events_t0 += s->cycle_ns;
+        }
+        s->event_due = s->events_t0 + s->events[s->next_event].at_ns;
+    }
+    return rearmed;
+}
+
+// CMD_SCENARIO en el shard: toma el escenario publicado y lo confirma; desde
+// ahí ninguna balanza del shard apunta al anterior.
+void scenario_switch(Shard *sh, unsigned int generation) {
+    const Scenario *sc = __atomic_load_n(&scenario, __ATOMIC_ACQUIRE);
+    long long now = now_ns();
+    for (int i = sh->first; i < sh->first + sh->count; i++) {
+        scenario_apply(&scales[i], sc, now, 1);
+        if (shm_slots) shm_update(&scales[i]);
+    }
+    __atomic_store_n(&sh->scenario_gen, generation, __ATOMIC_RELEASE);
+}
+
+// Cambio al estilo RCU: se publica el puntero nuevo, cada shard lo adopta
+// entre dos eventos de su bucle y el viejo se libera recién cuando todos
+// confirmaron. El envío nunca espera; sólo el hilo principal.
+void scenario_publish(Scenario *sc) {
+    Scenario *old = scenario;
+    __atomic_store_n(&scenario, sc, __ATOMIC_RELEASE);
+    for (int k = 0; k < n_shards; k++)
+        while (shard_send(&shards[k], CMD_SCENARIO, -1, sc->generation) != 0) nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+    for (int k = 0; k < n_shards; k++)
+        while (__atomic_load_n(&shards[k].scenario_gen, __ATOMIC_ACQUIRE) != sc->generation &&
+               __atomic_load_n(&running, __ATOMIC_ACQUIRE))
+            nanosleep(&(struct timespec){ .tv_nsec = 1000000 }, NULL);
+    scenario_free(old);
+}
+
+// SIGHUP: se relee el archivo; si no se puede aplicar entero sigue el actual
+void scenario_reload(void) {
+    if (!scenario_path) {
+        log_msg(LOG_ALWAYS, "SIGHUP sin --escenario: nada que recargar\n");
+        return;
+    }
+    char err[256];
+    Scenario *sc = scenario_load(scenario_path, err, sizeof(err));
+    if (sc && sc->n != scenario->n) snprintf(err, sizeof(err), "cambió la cantidad de balanzas (%d -> %d)", scenario->n, sc->n);
+    for (int i = 0; sc && !err[0] && i < sc->n; i++) {
+        const char *a = sc->ports[i], *b = scenario->ports[i];
+        if ((a == NULL) != (b == NULL) || (a && strcmp(a, b) != 0))
+            snprintf(err, sizeof(err), "cambió el puerto de la balanza %d; los puertos no se reabren", i);
+    }
+    if (!sc || err[0]) {
+        log_msg(LOG_ALWAYS, "Escenario %s sin cambios: %s\n", scenario_path, err);
+        scenario_free(sc);
+        return;
+    }
+    scenario_publish(sc);
+    log_msg(LOG_ALWAYS, "Escenario %s recargado (versión %u, %d balanzas, %d eventos)\n", scenario_path,
+            sc->generation, sc->n, sc->n_events);
+}
+
+void text_printf(TextBuf *t, const char *fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (t->len + n < t->cap) {
+            t->len += n;
+            return;
+        }
+        t->cap = (t->len + n + 1) * 2;
+        t->buf = realloc(t->buf, t->cap);
+        if (!t->buf) { perror("realloc"); exit(1); }
+    }
+}
+
+// Ejecuta un comando de control sobre una balanza o todas ("*"):
+//   pausa|reanuda|reset [i|*]   peso|tara i|* kg   tasa i|* hz   estado [i|*]
+// Agrega la respuesta a out, terminada en "OK\n" o "ERR ...\n".
+void control_command(char *line, TextBuf *out) {
+    char *save = NULL;
+    char *cmd = strtok_r(line, " \t\r\n", &save);
+    char *target = strtok_r(NULL, " \t\r\n", &save);
+    char *arg = strtok_r(NULL, " \t\r\n", &save);
+    int first = 0, last = n_scales - 1;
+
+    if (!cmd) {
+        text_printf(out, "ERR comando vacío\n");
+        return;
+    }
+    if (target && strcmp(target, "*") != 0) {
+        char *end;
+        long idx = strtol(target, &end, 10);
+        if (*end || idx < 0 || idx >= n_scales) {
+            text_printf(out, "ERR balanza inexistente: %s\n", target);
+            return;
+        }
+        first = last = idx;
+    }
+
+    double value = arg ? atof(arg) : 0;
+    if ((strcmp(cmd, "peso") == 0 || strcmp(cmd, "tara") == 0 || strcmp(cmd, "tasa") == 0) && !arg) {
+        text_printf(out, "ERR uso: %s <i|*> <valor>\n", cmd);
+        return;
+    }
+    if (strcmp(cmd, "tasa") == 0 && (value <= 0 || 1e9 / value < MIN_PERIOD_NS)) {
+        text_printf(out, "ERR frecuencia fuera de rango\n");
+        return;
+    }
+
+    // estado lee directo: son contadores que sólo escribe el shard dueño
+    if (strcmp(cmd, "estado") == 0) {
+        for (int i = first; i <= last; i++) {
+            const Scale *s = &scales[i];
+            text_printf(out, "%d %s %s %.1f %s %.3fms %lu\n", i, s->device, status_code[s->status],
+                        s->decimas / 10.0, s->paused ? "pausada" : "activa", s->period_ns / 1e6, s->produced);
+        }
+        text_printf(out, "OK\n");
+        return;
+    }
+
+    // El resto lo aplica el shard de cada balanza
+    int op;
+    int64_t v = 0;
+    if (strcmp(cmd, "pausa") == 0) op = CMD_PAUSE;
+    else if (strcmp(cmd, "reanuda") == 0) op = CMD_RESUME;
+    else if (strcmp(cmd, "reset") == 0) op = CMD_RESET;
+    else if (strcmp(cmd, "peso") == 0) op = CMD_LOAD, v = llround(value * 10.0);
+    else if (strcmp(cmd, "tara") == 0) op = CMD_TARE, v = llround(value * 10.0);
+    else if (strcmp(cmd, "tasa") == 0) op = CMD_RATE, v = llround(1e9 / value);
+    else {
+        text_printf(out, "ERR comando desconocido: %s\n", cmd);
+        return;
+    }
+    int err = first == last ? shard_send(shard_of(first), op, first, v) : broadcast_command(op, v);
+    if (err) {
+        text_printf(out, "ERR cola de comandos llena\n");
+        return;
+    }
+    log_msg(LOG_EVENT, "Control: %s %s%s%s\n", cmd, target ? target : "*", arg ? " " : "", arg ? arg : "");
+    text_printf(out, "OK\n");
+}
+
+void control_accept(void) {
+    for (;;) {
+        int fd = accept4(control_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        int idx = -1;
+        for (int i = 0; i < MAX_CONTROL; i++) if (control_conns[i].fd == -1) { idx = i; break; }
+        if (idx == -1) {
+            close(fd);
+            continue;
+        }
+        control_conns[idx].fd = fd;
+        control_conns[idx].len = 0;
+        if (epoll_add(fd, EV_TAG(EV_CTRL_CONN, idx)) == -1) close(fd);
+    }
+}
+
+void control_close(ControlConn *c) {
+    close(c->fd);
+    c->fd = -1;
+    free(c->out.buf);
+    c->out = (TextBuf){ 0 };
+    c->out_off = 0;
+}
+
+// Envía lo encolado; lo que no entra espera a EPOLLOUT. Un cliente que
+// manda comandos sin leer las respuestas se corta al pasar CONTROL_OUT_MAX.
+// Devuelve -1 si cerró la conexión.
+int control_flush(ControlConn *c) {
+    while (c->out_off < c->out.len) {
+        ssize_t w = send(c->fd, c->out.buf + c->out_off, c->out.len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) break;
+        if (w <= 0) {
+            control_close(c);
+            return -1;
+        }
+        c->out_off += w;
+    }
+    int pending = c->out_off < c->out.len;
+    if (!pending) c->out.len = c->out_off = 0;
+    else if (c->out.len - c->out_off > CONTROL_OUT_MAX) {
+        control_close(c);
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | (pending ? EPOLLOUT : 0),
+                              .data.u64 = EV_TAG(EV_CTRL_CONN, c - control_conns) };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+void control_read(ControlConn *c) {
+    for (;;) {
+        ssize_t r = read(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+            control_close(c);
+            return;
+        }
+        if (r < 0) return;
+        c->len += r;
+
+        char *start = c->buf;
+        char *nl;
+        while ((nl = memchr(start, '\n', c->buf + c->len - start)) != NULL) {
+            *nl = '\0';
+            control_command(start, &c->out);
+            start = nl + 1;
+        }
+        c->len -= start - c->buf;
+        memmove(c->buf, start, c->len);
+        if (c->len == (int)sizeof(c->buf) - 1) {
+            text_printf(&c->out, "ERR línea demasiado larga\n");
+            if (control_flush(c) == 0) control_close(c);
+            return;
+        }
+        if (control_flush(c) == -1) return;
+    }
+}
+
+void setup_control(void) {
+    for (int i = 0; i < MAX_CONTROL; i++) control_conns[i].fd = -1;
+    if (!cfg.control_path) return;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(cfg.control_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: ruta del socket de control demasiado larga.\n");
+        exit(1);
+    }
+    strcpy(addr.sun_path, cfg.control_path);
+    unlink(cfg.control_path);
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(control_fd, MAX_CONTROL) == -1) {
+        fprintf(stderr, "%s: ", cfg.control_path);
+        perror("No se puede crear el socket de control");
+        exit(1);
+    }
+    if (epoll_add(control_fd, EV_TAG(EV_CONTROL, 0)) == -1) { perror("epoll_ctl"); exit(1); }
+}
+
+// Endpoint de métricas (--metricas [ip:]puerto): GET /metrics responde en
+// el formato de texto de Prometheus. Lo atiende el hilo principal; los
+// contadores son los de cada balanza, que escribe sólo el shard dueño en
+// su propia línea de caché (Scale está alineada a 64), así que leerlos no
+// le agrega nada al camino de envío.
+// Una métrica con su valor para cada balanza
+#define METRIC_EACH(t, name, type, help, fmt, expr)                                                 \
+    do {                                                                                            \
+        text_printf(t, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);                     \
+        for (int i = 0; i < n_scales; i++) {                                                        \
+            const Scale *s = &scales[i];                                                            \
+            text_printf(t, "%s{balanza=\"%d\",dispositivo=\"%s\"} " fmt "\n", name, i, s->device, expr); \
+        }                                                                                           \
+    } while (0)
+
+void metrics_render(TextBuf *t) {
+    METRIC_EACH(t, "balanza_tramas_total", "counter", "Tramas enviadas completas.", "%lu", s->frames);
+    METRIC_EACH(t, "balanza_bytes_total", "counter", "Bytes escritos al puerto.", "%llu", s->bytes);
+    METRIC_EACH(t, "balanza_errores_escritura_total", "counter", "Escrituras fallidas.", "%lu", s->write_errors);
+    METRIC_EACH(t, "balanza_escrituras_parciales_total", "counter", "Escrituras cortas.", "%lu", s->short_writes);
+    METRIC_EACH(t, "balanza_descartadas_total", "counter", "Tramas descartadas por cola llena.", "%lu", s->dropped);
+    METRIC_EACH(t, "balanza_demoradas_total", "counter", "Tramas demoradas por cola llena.", "%lu", s->delayed);
+    METRIC_EACH(t, "balanza_plazos_perdidos_total", "counter", "Plazos vencidos sin trama propia.", "%lu", s->missed);
+
+    text_printf(t, "# HELP balanza_resets_total Vueltas de la rampa al valor de reinicio.\n"
+                   "# TYPE balanza_resets_total counter\n");
+    for (int i = 0; i < n_scales; i++) {
+        const Scale *s = &scales[i];
+        text_printf(t, "balanza_resets_total{balanza=\"%d\",dispositivo=\"%s\",origen=\"auto\"} %lu\n", i,
+                    s->device, s->resets_auto);
+        text_printf(t, "balanza_resets_total{balanza=\"%d\",dispositivo=\"%s\",origen=\"manual\"} %lu\n", i,
+                    s->device, s->resets_manual);
+    }
+
+    METRIC_EACH(t, "balanza_pausada", "gauge", "1 si la balanza está en pausa.", "%d", s->paused);
+    METRIC_EACH(t, "balanza_peso_kg", "gauge", "Peso bruto mostrado.", "%.1f", s->decimas / 10.0);
+    METRIC_EACH(t, "balanza_tara_kg", "gauge", "Tara.", "%.1f", s->tare / 10.0);
+    METRIC_EACH(t, "balanza_estado", "gauge", "0 = ST, 1 = US, 2 = OL.", "%d", s->status);
+    METRIC_EACH(t, "balanza_frecuencia_hz", "gauge", "Tramas por segundo configuradas.", "%.3f", 1e9 / s->period_ns);
+
+    if (cfg.faults) {
+        text_printf(t, "# HELP balanza_fallas_total Fallas inyectadas con --fallas.\n"
+                       "# TYPE balanza_fallas_total counter\n");
+        for (int i = 0; i < n_scales; i++)
+            for (int k = FAULT_CORRUPT; k < N_FAULTS; k++)
+                text_printf(t, "balanza_fallas_total{balanza=\"%d\",dispositivo=\"%s\",tipo=\"%s\"} %lu\n", i,
+                            scales[i].device, fault_names[k], scales[i].faults[k]);
+    }
+
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+    text_printf(t, "# HELP balanza_jitter_segundos Inicio de escritura menos plazo.\n"
+                   "# TYPE balanza_jitter_segundos summary\n");
+    for (int i = 0; i < n_scales; i++) {
+        const Scale *s = &scales[i];
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            text_printf(t, "balanza_jitter_segundos{balanza=\"%d\",dispositivo=\"%s\",quantile=\"%g\"} %.9f\n", i,
+                        s->device, quantiles[q], hist_percentile(&s->jitter, quantiles[q]) / 1e9);
+        text_printf(t, "balanza_jitter_segundos_count{balanza=\"%d\",dispositivo=\"%s\"} %llu\n", i, s->device,
+                    (unsigned long long)__atomic_load_n(&s->jitter.total, __ATOMIC_RELAXED));
+    }
+}
+
+void metrics_close(MetricsConn *c) {
+    close(c->fd);
+    c->fd = -1;
+    free(c->out);
+    c->out = NULL;
+}
+
+void metrics_flush(MetricsConn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t w = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && errno == EAGAIN) {
+            struct epoll_event ev = { .events = EPOLLOUT, .data.u64 = EV_TAG(EV_METRICS_CONN, c - metrics_conns) };
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+            return;
+        }
+        if (w <= 0) break;
+        c->out_off += w;
+    }
+    metrics_close(c);
+}
+
+// Petición completa: sólo se mira la primera línea
+void metrics_respond(MetricsConn *c) {
+    TextBuf body = { 0 };
+    const char *status = "200 OK";
+    if (strncmp(c->req, "GET /metrics ", 13) == 0 || strncmp(c->req, "GET /metrics?", 13) == 0) {
+        metrics_render(&body);
+    } else {
+        status = "404 Not Found";
+        text_printf(&body, "Sólo GET /metrics\n");
+    }
+    TextBuf out = { 0 };
+    text_printf(&out, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                      "Content-Length: %zu\r\nConnection: close\r\n\r\n%.*s",
+                status, body.len, (int)body.len, body.buf);
+    free(body.buf);
+    c->out = out.buf;
+    c->out_len = out.len;
+    c->out_off = 0;
+    metrics_flush(c);
+}
+
+void metrics_read(MetricsConn *c) {
+    for (;;) {
+        ssize_t r = read(c->fd, c->req + c->len, sizeof(c->req) - 1 - c->len);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+            metrics_close(c);
+            return;
+        }
+        if (r < 0) return;
+        c->len += r;
+        c->req[c->len] = '\0';
+        if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")) {
+            metrics_respond(c);
+            return;
+        }
+        if (c->len == (int)sizeof(c->req) - 1) {
+            metrics_close(c);
+            return;
+        }
+    }
+}
+
+void metrics_event(MetricsConn *c) {
+    if (c->out) metrics_flush(c);
+    else metrics_read(c);
+}
+
+void metrics_accept(void) {
+    for (;;) {
+        int fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        int idx = -1;
+        for (int i = 0; i < MAX_METRICS_CONN; i++) if (metrics_conns[i].fd == -1) { idx = i; break; }
+        if (idx == -1) {
+            close(fd);
+            continue;
+        }
+        metrics_conns[idx].fd = fd;
+        metrics_conns[idx].len = 0;
+        if (epoll_add(fd, EV_TAG(EV_METRICS_CONN, idx)) == -1) metrics_close(&metrics_conns[idx]);
+    }
+}
+
+void setup_metrics(void) {
+    for (int i = 0; i < MAX_METRICS_CONN; i++) metrics_conns[i].fd = -1;
+    if (!cfg.metrics_enabled) return;
+
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(metrics_fd, (struct sockaddr *)&cfg.metrics_addr, sizeof(cfg.metrics_addr)) == -1 ||
+        listen(metrics_fd, MAX_METRICS_CONN) == -1) {
+        fprintf(stderr, "Métricas %d: ", ntohs(cfg.metrics_addr.sin_port));
+        perror("No se puede escuchar");
+        exit(1);
+    }
+    if (epoll_add(metrics_fd, EV_TAG(EV_METRICS, 0)) == -1) { perror("epoll_ctl"); exit(1); }
+}
+
+// Señales como eventos del bucle: SIGINT/SIGTERM terminan, SIGUSR1 vuelca
+// los histogramas, SIGUSR2 los empieza de nuevo y SIGHUP recarga el
+// escenario. Se bloquean antes de crear hilos para que sólo las reciba el
+// signalfd.
+void setup_signals(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1) { perror("signalfd"); exit(1); }
+    if (epoll_add(sig_fd, EV_TAG(EV_SIGNAL, 0)) == -1) { perror("epoll_ctl"); exit(1); }
+}
+
+void handle_signals(void) {
+    struct signalfd_siginfo si;
+    while (read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1) dump_histograms();
+        else if (si.ssi_signo == SIGUSR2) __atomic_add_fetch(&hist_generation, 1, __ATOMIC_RELAXED);
+        else if (si.ssi_signo == SIGHUP) scenario_reload();
+        else request_stop();
+    }
+}
+
+// Periodo del timer para sacar hz tramas/s en ráfagas de stress.burst
+static inline long long stress_period(double frame_ns) { return llround(frame_ns * stress.burst); }
+
+static inline double stress_hz(const Scale *s) { return 1e9 * stress.burst / s->period_ns; }
+
+void stress_begin(Scale *s, long long now) {
+    StressState *st = s->stress;
+    long long len = STRESS_STEP_FRAMES * s->period_ns / stress.burst;
+    st->step_start = now;
+    st->step_end = now + (len > STRESS_STEP_NS ? len : STRESS_STEP_NS);
+    st->frames0 = s->frames;
+    st->lost0 = s->dropped + s->delayed;
+    st->missed0 = s->missed;
+    st->short0 = s->short_writes;
+    st->due = now;
+}
+
+// Cierra el escalón actual y sube la frecuencia. El último escalón es el
+// que ya va a la velocidad de la línea: las tramas salen pegadas.
+void stress_step(Scale *s, long long now) {
+    StressState *st = s->stress;
+    StressStep *step = &st->steps[st->n_steps++];
+    step->hz = stress_hz(s);
+    step->achieved = (s->frames - st->frames0) * 1e9 / (now - st->step_start);
+    step->lost = s->dropped + s->delayed - st->lost0;
+    step->missed = s->missed - st->missed0;
+    step->short_writes = s->short_writes - st->short0;
+    step->kernel_queue = port_queued(s);
+    self->syscalls++;
+
+    double frame_ns = (double)s->period_ns / stress.burst;
+    long long floor_ns = s->line_ns > MIN_PERIOD_NS ? s->line_ns : MIN_PERIOD_NS;
+    if (frame_ns <= floor_ns || st->n_steps == STRESS_MAX_STEPS) {
+        struct itimerspec off = { 0 };
+        timerfd_settime(s->tfd, 0, &off, NULL);
+        st->done = 1;
+        log_msg(LOG_EVENT, "[%s] Estrés: curva terminada en %.1f tramas/s\n", s->device, step->hz);
+        if (__atomic_sub_fetch(&stress.active_scales, 1, __ATOMIC_ACQ_REL) == 0) request_stop();
+        return;
+    }
+    frame_ns /= STRESS_FACTOR;
+    if (frame_ns < floor_ns) frame_ns = floor_ns;
+    long long period = stress_period(frame_ns);
+    if (period < MIN_PERIOD_NS) period = MIN_PERIOD_NS;
+    s->period_ns = period;
+    arm_periodic(s, now + period);
+    stress_begin(s, now);
+    log_msg(LOG_EVENT, "[%s] Estrés: %.1f tramas/s (%.1f logradas, %lu perdidas), sigue con %.1f\n", s->device,
+            step->hz, step->achieved, step->lost, stress_hz(s));
+}
+
+// Hueco al azar con media un periodo (exponencial, acotado a 8 periodos)
+static inline long long stress_gap(Scale *s) {
+    double gap = -log(1.0 - rng_double(&s->stress->rng)) * s->period_ns;
+    return gap < 8.0 * s->period_ns ? llround(gap) : 8 * s->period_ns;
+}
+
+void stress_timer(Scale *s, uint64_t expirations) {
+    StressState *st = s->stress;
+    if (st->done) return;
+    long long now = now_ns();
+    if (!st->warm && now >= st->step_end) {
+        st->warm = 1;
+        stress_begin(s, now);
+    }
+    if (now >= st->step_end) {
+        // El timer periódico quedó rearmado con la nueva frecuencia: las
+        // expiraciones que trajo este evento eran de la anterior
+        stress_step(s, now);
+        if (st->done || stress.pattern != STRESS_RANDOM) return;
+    }
+    if (stress.pattern == STRESS_RANDOM) {
+        // Timer de un disparo; los plazos que ya pasaron salen seguidos
+        int sent = 0;
+        for (; st->due <= now && sent < OUTQ_SLOTS; sent++) {
+            s->deadline_ns = st->due;
+            for (int b = 0; b < stress.burst && !s->paused; b++) send_frame(s);
+            st->due += stress_gap(s);
+        }
+        if (st->due <= now) {
+            s->missed++;
+            st->due = now + stress_gap(s);
+        }
+        arm_oneshot(s, st->due);
+    } else {
+        s->tick += expirations;
+        s->missed += expirations - 1;
+        s->deadline_ns = s->start_ns + (long long)(s->tick - 1) * s->period_ns;
+        for (int b = 0; b < stress.burst && !s->paused; b++) send_frame(s);
+    }
+    flush_output(s);
+}
+
+void stress_report(void) {
+    for (int i = 0; i < n_scales; i++) {
+        const StressState *st = scales[i].stress;
+        log_msg(LOG_ALWAYS, "%s: curva de capacidad\n", scales[i].device);
+        log_msg(LOG_ALWAYS, "  %12s %12s %10s %10s %10s %10s\n", "pedidas/s", "logradas/s", "perdidas", "vencidos",
+                "parciales", "cola tty");
+        const StressStep *brk = NULL, *self_limit = NULL;
+        for (int k = 0; k < st->n_steps; k++) {
+            const StressStep *p = &st->steps[k];
+            log_msg(LOG_ALWAYS, "  %12.1f %12.1f %10lu %10lu %10lu %10d\n", p->hz, p->achieved, p->lost, p->missed,
+                    p->short_writes, p->kernel_queue);
+            if (!brk && p->lost > 0) brk = p;
+            if (!self_limit && p->missed > 0) self_limit = p;
+        }
+        if (brk)
+            log_msg(LOG_ALWAYS, "  Ruptura: pérdidas desde %.1f tramas/s (logradas %.1f)\n", brk->hz, brk->achieved);
+        else if (st->n_steps)
+            log_msg(LOG_ALWAYS, "  Sin pérdidas hasta %.1f tramas/s\n", st->steps[st->n_steps - 1].hz);
+        if (self_limit)
+            log_msg(LOG_ALWAYS, "  El simulador venció plazos desde %.1f tramas/s\n", self_limit->hz);
+    }
+}
+
+void cleanup(void) {
+    for (int i = 0; i < n_scales; i++) {
+        if (scales[i].fd > 0) close(scales[i].fd);
+        if (scales[i].tfd > 0) close(scales[i].tfd);
+        if (scales[i].peer_fd >= 0) close(scales[i].peer_fd);
+        if (scales[i].link) unlink(scales[i].link);
+        if (scales[i].net.listen_fd >= 0) close(scales[i].net.listen_fd);
+    }
+    if (epfd >= 0) close(epfd);
+    for (int k = 0; k < n_shards; k++) {
+        close(shards[k].epfd);
+        close(shards[k].cmd_fd);
+    }
+    if (shm_slots) shm_unlink(cfg.shm_name);
+    if (control_fd >= 0) {
+        close(control_fd);
+        unlink(cfg.control_path);
+    }
+    if (metrics_fd >= 0) close(metrics_fd);
+    tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios);
+    log_stop();
+    if (trace_fd >= 0) {
+        unsigned long records = 0, lost = 0;
+        for (int k = 0; k < n_shards; k++) {
+            recorder_close(shards[k].recorder);
+            records += shards[k].recorder->records;
+            lost += shards[k].recorder->lost;
+        }
+        close(trace_fd);
+        log_msg(LOG_ALWAYS, "Traza: %lu registros grabados, %lu perdidos\n", records - lost, lost);
+    }
+    log_msg(LOG_ALWAYS, "%s", cfg.msg_exit);
+    for (int i = 0; i < n_scales; i++)
+        log_msg(LOG_ALWAYS, cfg.msg_summary, scales[i].device, scales[i].frames, scales[i].missed,
+               scales[i].dropped, scales[i].delayed, scales[i].short_writes, scales[i].write_errors);
+    for (int i = 0; i < n_scales && (cfg.tcp_port || cfg.udp_enabled); i++) {
+        NetOut *n = &scales[i].net;
+        log_msg(LOG_ALWAYS, "%s: red %lu clientes, %lu cortados, %lu bytes saltados, %lu errores UDP\n",
+                scales[i].device, n->accepted, n->cut, n->skipped, n->udp_errors);
+    }
+    for (int i = 0; i < n_scales && cfg.faults; i++) {
+        char text[LOG_LINE];
+        int len = snprintf(text, sizeof(text), "%s: fallas", scales[i].device);
+        for (int k = FAULT_CORRUPT; k < N_FAULTS && len < (int)sizeof(text); k++)
+            if (cfg.fault_p[k] > 0)
+                len += snprintf(text + len, sizeof(text) - len, " %s %lu", fault_names[k], scales[i].faults[k]);
+        log_msg(LOG_ALWAYS, "%s\n", text);
+    }
+    dump_histograms();
+    if (stress.pattern) stress_report();
+
+    // Costo por trama: llamadas al sistema de los hilos de envío y CPU de
+    // todo el proceso
+    unsigned long frames = 0, syscalls = 0, writes = 0, enters = 0;
+    for (int i = 0; i < n_scales; i++) frames += scales[i].frames;
+    for (int k = 0; k < n_shards; k++) {
+        syscalls += shards[k].syscalls;
+        if (shards[k].ring) {
+            writes += shards[k].ring->writes;
+            enters += shards[k].ring->enters;
+        }
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    if (frames)
+        log_msg(LOG_ALWAYS, "Por trama: %.2f llamadas al sistema, %.2fus de CPU (%s)\n", (double)syscalls / frames,
+                cpu * 1e6 / frames, cfg.io_uring ? "io_uring" : "writev");
+    if (enters)
+        log_msg(LOG_ALWAYS, "io_uring: %lu escrituras en %lu io_uring_enter (%.1f por llamada)\n", writes, enters,
+                (double)writes / enters);
+    exit(0);
+}
+
+// Reproducción con marcas de tiempo: sale todo lo que ya venció y el timer
+// se rearma para el próximo registro de la traza.
+void replay_timer(Scale *s) {
+    int sent = 0;
+    long long now = now_ns();
+    while (!s->replay_done && sent < OUTQ_SLOTS) {
+        long long due = replay_due_ns(s);
+        if (due > now) break;
+        s->deadline_ns = due;
+        if (s->paused) replay_value(s);
+        else send_frame(s);
+        sent++;
+    }
+    if (!s->replay_done) arm_oneshot(s, replay_due_ns(s));
+    flush_output(s);
+}
+
+// Aplica los comandos pendientes a las balanzas del shard
+void shard_commands(Shard *sh) {
+    eventfd_t count;
+    eventfd_read(sh->cmd_fd, &count);
+    unsigned int head = sh->cmds.head;
+    unsigned int tail = __atomic_load_n(&sh->cmds.tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const Command *c = &sh->cmds.slots[head % CMD_SLOTS];
+        int first = c->scale < 0 ? sh->first : c->scale;
+        int last = c->scale < 0 ? sh->first + sh->count : c->scale + 1;
+        if (c->op == CMD_SCENARIO) {
+            scenario_switch(sh, (unsigned int)c->value);
+            continue;
+        }
+        for (int i = first; i < last; i++) apply_command(&scales[i], c->op, c->value);
+    }
+    __atomic_store_n(&sh->cmds.head, head, __ATOMIC_RELEASE);
+}
+
+// Bucle de un shard: sólo eventos de sus balanzas y su cola de comandos
+void run_loop(Shard *sh) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        sh->syscalls++;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+            if (EV_KIND(tag) == EV_TIMER) {
+                Scale *s = &scales[EV_INDEX(tag)];
+                uint64_t expirations;
+                sh->syscalls++;
+                if (read(s->tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) continue;
+                if (replay.timed) {
+                    replay_timer(s);
+                    continue;
+                }
+                if (s->stress) {
+                    stress_timer(s, expirations);
+                    continue;
+                }
+                if (s->replay_done) continue;
+                unsigned long first = s->tick;
+                s->tick += expirations;
+                // Un evento "tasa" rearma el timer: este plazo ya no vale
+                if (s->start_ns + (long long)(s->tick - 1) * s->period_ns >= s->event_due && scenario_events(s))
+                    continue;
+                if (s->paused) continue;
+
+                // Más de una expiración = plazos vencidos mientras el bucle
+                // estaba ocupado: se recuperan enviando las tramas atrasadas
+                // o se saltan, pero siempre quedan contados.
+                if (expirations > 1) {
+                    if (cfg.catch_up) {
+                        for (uint64_t k = 0; k + 1 < expirations; k++) {
+                            s->deadline_ns = s->start_ns + (long long)(first + k) * s->period_ns;
+                            send_frame(s);
+                        }
+                    }
+                    s->missed += expirations - 1;
+                }
+                s->deadline_ns = s->start_ns + (long long)(s->tick - 1) * s->period_ns;
+                send_frame(s);
+                flush_output(s);
+                if (sh->refill) sh->refill[sh->n_refill++] = s - scales;
+            } else if (EV_KIND(tag) == EV_PORT) {
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) port_dead(&scales[EV_INDEX(tag)], 0);
+                else flush_output(&scales[EV_INDEX(tag)]);
+            } else if (EV_KIND(tag) == EV_CLIENT) {
+                client_event(&clients[EV_INDEX(tag)], events[i].events);
+            } else if (EV_KIND(tag) == EV_LISTEN) {
+                net_accept(&scales[EV_INDEX(tag)]);
+            } else if (EV_KIND(tag) == EV_COMMAND) {
+                shard_commands(sh);
+            } else if (EV_KIND(tag) == EV_URING) {
+                uring_reap(sh->ring);
+            }
+        }
+        if (sh->ring) uring_run(sh->ring);
+
+        // Con todo lo de esta vuelta ya escrito se adelantan las tramas
+        // de los próximos plazos
+        for (int k = 0; k < sh->n_refill; k++) lookahead_fill(&scales[sh->refill[k]]);
+        sh->n_refill = 0;
+    }
+}
+
+// Registra en el epoll del shard los descriptores de sus balanzas
+void *shard_thread(void *arg) {
+    Shard *sh = arg;
+    self = sh;
+    epfd = sh->epfd;
+    log_ring = sh->log;
+    if (sh->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(sh->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (epoll_add(sh->cmd_fd, EV_TAG(EV_COMMAND, sh->id)) == -1) { perror("epoll_ctl"); exit(1); }
+    if (cfg.io_uring) {
+        unsigned entries = 1;
+        while (entries < (unsigned)sh->count && entries < URING_MAX_ENTRIES) entries <<= 1;
+        sh->ring = uring_open(entries);
+        if (!sh->ring) { perror("io_uring_setup"); exit(1); }
+        if (epoll_add(sh->ring->fd, EV_TAG(EV_URING, sh->id)) == -1) { perror("epoll_ctl"); exit(1); }
+    }
+    if (cfg.lookahead) {
+        // Una balanza puede vencer varias veces en una vuelta
+        sh->refill = malloc(MAX_EVENTS * sizeof(int));
+        if (!sh->refill) { perror("malloc"); exit(1); }
+    }
+    for (int i = sh->first; i < sh->first + sh->count; i++) {
+        Scale *s = &scales[i];
+        lookahead_fill(s);
+        if (epoll_add(s->tfd, EV_TAG(EV_TIMER, i)) == -1) { perror("epoll_ctl"); exit(1); }
+        struct epoll_event ev = { .events = 0, .data.u64 = EV_TAG(EV_PORT, i) };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1) { perror("epoll_ctl"); exit(1); }
+        if (s->net.listen_fd >= 0 && epoll_add(s->net.listen_fd, EV_TAG(EV_LISTEN, i)) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+    run_loop(sh);
+    return NULL;
+}
+
+// Reparte las balanzas en rangos contiguos y el pool de clientes TCP en
+// partes iguales. Cada shard tiene su cola de consola y, si se graba, su
+// grabador.
+void shards_init(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_shards == 0) n_shards = ncpu > 0 ? ncpu : 1;
+    if (n_shards > n_scales) n_shards = n_scales;
+    if (n_shards > MAX_SHARDS) n_shards = MAX_SHARDS;
+    if (posix_memalign((void **)&shards, 64, n_shards * sizeof(Shard)) != 0) { perror("posix_memalign"); exit(1); }
+    memset(shards, 0, n_shards * sizeof(Shard));
+
+    for (int k = 0; k < n_shards; k++) {
+        Shard *sh = &shards[k];
+        sh->id = k;
+        sh->first = (long long)n_scales * k / n_shards;
+        sh->count = (long long)n_scales * (k + 1) / n_shards - sh->first;
+        sh->cpu = pin_shards && ncpu > 0 ? k % ncpu : -1;
+        sh->epfd = epoll_create1(EPOLL_CLOEXEC);
+        sh->cmd_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (sh->epfd == -1 || sh->cmd_fd == -1) { perror("epoll_create1/eventfd"); exit(1); }
+        sh->log = calloc(1, sizeof(LogRing));
+        log_rings[n_log_rings++] = sh->log;
+        if (trace_fd >= 0) sh->recorder = recorder_open(trace_fd);
+        rng_seed(&sh->phys_rng, seed, MAX_SCALES + 1 + k);
+
+        int lo = MAX_CLIENTS * k / n_shards, hi = MAX_CLIENTS * (k + 1) / n_shards;
+        sh->free_client = -1;
+        for (int i = hi - 1; i >= lo; i--) {
+            clients[i].scale = -1;
+            clients[i].next = sh->free_client;
+            sh->free_client = i;
+        }
+    }
+}
+
+// Los hilos nacen con todas las señales bloqueadas: las lee el signalfd
+void shards_start(void) {
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int k = 0; k < n_shards; k++) {
+        if (pthread_create(&shards[k].thread, NULL, shard_thread, &shards[k]) != 0) {
+            fprintf(stderr, "Error: no se pudo crear el hilo del shard %d.\n", k);
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void shards_stop(void) {
+    for (int k = 0; k < n_shards; k++) eventfd_write(shards[k].cmd_fd, 1);
+    for (int k = 0; k < n_shards; k++) pthread_join(shards[k].thread, NULL);
+    for (int k = 0; k < n_shards; k++) if (shards[k].ring) uring_close(shards[k].ring);
+}
+
+// Hilo principal: señales, teclado y socket de control
+void control_loop(void) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+            if (EV_KIND(tag) == EV_SIGNAL) {
+                handle_signals();
+            } else if (EV_KIND(tag) == EV_CONTROL) {
+                control_accept();
+            } else if (EV_KIND(tag) == EV_CTRL_CONN) {
+                ControlConn *c = &control_conns[EV_INDEX(tag)];
+                if ((events[i].events & EPOLLOUT) && control_flush(c) == -1) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) control_read(c);
+            } else if (EV_KIND(tag) == EV_METRICS) {
+                metrics_accept();
+            } else if (EV_KIND(tag) == EV_METRICS_CONN) {
+                metrics_event(&metrics_conns[EV_INDEX(tag)]);
+            } else if (EV_KIND(tag) == EV_STDIN) {
+                char c;
+                ssize_t r = read(STDIN_FILENO, &c, 1);
+                if (r == 1) handle_key(c);
+                else if (r == 0) epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            } else if (EV_KIND(tag) == EV_WAKE) {
+                eventfd_t count;
+                eventfd_read(wake_fd, &count);
+            }
+        }
+    }
+}
+
+// Lado del consumidor (--validar): lee los -d que escribe otro balanza5
+// (esclavo de un PTY, el otro extremo de un cable null-modem, un servidor
+// serie) y valida cada trama. Las líneas completas se revisan dentro del
+// buffer de lectura; sólo la cola partida entre dos read() se copia.
+typedef struct {
+    const char *path;
+    int fd;
+    char carry[VALIDATE_LINE];  // línea partida entre dos lecturas
+    int carry_len;
+    int overflow;               // la línea actual ya no entra: es basura
+    int synced;                 // ya vio un '\n'; lo anterior era media trama
+    unsigned long frames;
+    unsigned long corrupt;      // líneas que no son una trama válida
+    unsigned long long bytes;
+    unsigned long long garbage; // bytes sobrantes antes de una trama
+    long long last_ns;
+    Hist interval;              // tiempo entre tramas
+} ValidatorPort;
+
+ValidatorPort *vports;
+int n_vports;
+Frame vframe;
+Recorder *vrecorder;
+
+// Trama recibida; NULL si la línea estaba dañada
+void validator_frame(ValidatorPort *v, const FrameMeta *m, long long now) {
+    static const FrameMeta bad = { 0 };
+    if (!m) {
+        v->corrupt++;
+        if (vrecorder) recorder_add(vrecorder, now, v - vports, &bad, TRACE_CORRUPT);
+        return;
+    }
+    v->frames++;
+    if (v->last_ns) hist_record(&v->interval, now - v->last_ns);
+    v->last_ns = now;
+    if (vrecorder) recorder_add(vrecorder, now, v - vports, m, 0);
+}
+
+// Una línea terminada en '\n'. La trama válida va al final; lo que haya
+// antes es ruido de la línea, que puede traer sus propias comas. Se prueba
+// cada coma como la primera de la trama: se vuelve a codificar el valor
+// leído y se compara byte a byte con el final de la línea, así cualquier
+// dígito, espacio o sufijo alterado se detecta sin un parser aparte.
+void validator_line(ValidatorPort *v, const char *line, size_t n, long long now) {
+    FrameMeta m = { 0 };
+    const char *end = line + n;
+    int ok = 0;
+    for (const char *c = line; !ok && (c = memchr(c, ',', end - c)) != NULL; c++) {
+        const char *start = c - 2;
+        if (c - line < 2 || !parse_frame_text(start, end, &m.decimas, &m.status)) continue;
+        int len = frame_encode(&vframe, m.decimas);
+        frame_set_status(&vframe, m.status);
+        if (end - start == len && memcmp(start, vframe.bytes, len) == 0) {
+            ok = 1;
+            v->garbage += start - line;
+        }
+    }
+    validator_frame(v, ok ? &m : NULL, now);
+}
+
+void validator_feed(ValidatorPort *v, const char *buf, size_t len, long long now) {
+    const char *p = buf, *end = buf + len;
+    v->bytes += len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = (nl ? nl + 1 : end) - p;
+        if (v->overflow || v->carry_len + n > sizeof(v->carry)) {
+            v->garbage += v->carry_len + n;
+            v->carry_len = 0;
+            v->overflow = !nl;
+            if (nl && v->synced) validator_frame(v, NULL, now);
+            v->synced |= nl != NULL;
+            p += n;
+            continue;
+        }
+        if (!nl) {
+            memcpy(v->carry + v->carry_len, p, n);
+            v->carry_len += n;
+            return;
+        }
+        const char *line = p;
+        if (v->carry_len) {
+            memcpy(v->carry + v->carry_len, p, n);
+            line = v->carry;
+            n += v->carry_len;
+            v->carry_len = 0;
+        }
+        p = nl + 1;
+        if (v->synced) validator_line(v, line, n, now);
+        v->synced = 1;
+    }
+}
+
+void validator_report(long long elapsed_ns) {
+    unsigned long frames = 0, corrupt = 0;
+    unsigned long long bytes = 0, garbage = 0;
+    for (int i = 0; i < n_vports; i++) {
+        ValidatorPort *v = &vports[i];
+        frames += v->frames;
+        corrupt += v->corrupt;
+        bytes += v->bytes;
+        garbage += v->garbage;
+    }
+    double secs = elapsed_ns / 1e9;
+    printf("Validando %d puertos: %lu tramas (%.1f/s, %.0f B/s), %lu dañadas, %llu bytes de ruido", n_vports,
+           frames, frames / secs, bytes / secs, corrupt, garbage);
+    if (cfg.period_ns) printf(", %.1f%% de lo esperado", 100.0 * frames / (secs * 1e9 / cfg.period_ns * n_vports));
+    printf("\n");
+}
+
+int run_validator(const char **paths, int n, const char *record_path) {
+    vports = calloc(n, sizeof(ValidatorPort));
+    n_vports = n;
+    frame_init(&vframe);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    for (int i = 0; i < n; i++) {
+        ValidatorPort *v = &vports[i];
+        v->path = paths[i];
+        v->fd = open(paths[i], O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (v->fd == -1) {
+            fprintf(stderr, "%s: ", paths[i]);
+            perror("No se puede abrir el puerto");
+            return 1;
+        }
+        // Lo que quedó en la cola antes de arrancar tiene una latencia que no
+        // es de la línea: se descarta y se empieza en la próxima trama
+        if (isatty(v->fd)) {
+            apply_line_settings(v->fd);
+            tcflush(v->fd, TCIFLUSH);
+        }
+        if (epoll_add(v->fd, EV_TAG(EV_PORT, i)) == -1) { perror("epoll_ctl"); return 1; }
+    }
+    if (record_path) vrecorder = recorder_open(trace_open(record_path, n));
+    setup_signals();
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its = { .it_interval = { 1, 0 }, .it_value = { 1, 0 } };
+    timerfd_settime(tfd, 0, &its, NULL);
+    epoll_add(tfd, EV_TAG(EV_TIMER, 0));
+    printf("Validando %d puertos. Ctrl+C para terminar (SIGUSR1 muestra los histogramas).\n", n);
+
+    static char buf[65536];
+    struct epoll_event events[MAX_EVENTS];
+    long long start = now_ns();
+    int open_ports = n;
+    running = 1;
+    while (running && open_ports > 0) {
+        int k = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (k == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        long long now = now_ns();
+        for (int e = 0; e < k; e++) {
+            uint64_t tag = events[e].data.u64;
+            if (EV_KIND(tag) == EV_SIGNAL) {
+                struct signalfd_siginfo si;
+                while (read(sig_fd, &si, sizeof(si)) == sizeof(si)) {
+                    if (si.ssi_signo == SIGUSR2) continue;
+                    if (si.ssi_signo != SIGUSR1) running = 0;
+                    for (int i = 0; i < n && si.ssi_signo == SIGUSR1; i++) {
+                        printf("%s:\n", vports[i].path);
+                        hist_print("intervalo", &vports[i].interval);
+                    }
+                }
+            } else if (EV_KIND(tag) == EV_TIMER) {
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations)) validator_report(now - start);
+            } else {
+                ValidatorPort *v = &vports[EV_INDEX(tag)];
+                ssize_t len;
+                while ((len = read(v->fd, buf, sizeof(buf))) > 0) validator_feed(v, buf, len, now);
+                // El emisor cerró el PTY (EIO) o el puerto desapareció
+                if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR)) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, v->fd, NULL);
+                    printf("%s: cerrado por el otro extremo\n", v->path);
+                    open_ports--;
+                }
+            }
+        }
+    }
+
+    long long elapsed = now_ns() - start;
+    printf("\n");
+    for (int i = 0; i < n; i++) {
+        ValidatorPort *v = &vports[i];
+        printf("%s: %lu tramas, %lu dañadas, %llu bytes de ruido, %llu bytes\n", v->path, v->frames, v->corrupt,
+               v->garbage, v->bytes);
+        hist_print("intervalo", &v->interval);
+        close(v->fd);
+    }
+    validator_report(elapsed);
+    if (vrecorder) {
+        recorder_close(vrecorder);
+        printf("Traza recibida: %lu registros, %lu perdidos. Comparar con --comparar enviada.bin,%s\n",
+               vrecorder->records - vrecorder->lost, vrecorder->lost, record_path);
+    }
+    return 0;
+}
+
+// Registros de un puerto, en orden, sin copiar los de la traza
+typedef struct {
+    const TraceRecord **recs;
+    size_t n;
+} PortRecords;
+
+const TraceRecord *trace_map(const char *path, size_t *n, uint32_t *n_ports) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) { fprintf(stderr, "%s: ", path); perror("No se puede abrir la traza"); exit(1); }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size < (off_t)sizeof(TraceHeader)) { fprintf(stderr, "%s: traza vacía\n", path); exit(1); }
+    const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { perror("mmap"); exit(1); }
+    const TraceHeader *h = (const TraceHeader *)map;
+    if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 || h->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: no es una traza de balanza\n", path);
+        exit(1);
+    }
+    madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+    *n = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    *n_ports = h->n_ports ? h->n_ports : 1;
+    return (const TraceRecord *)(map + sizeof(TraceHeader));
+}
+
+// Con varios shards los bloques de la traza se intercalan: se separa por
+// puerto en una pasada, guardando punteros
+PortRecords *trace_split(const TraceRecord *recs, size_t n, uint32_t n_ports) {
+    PortRecords *p = calloc(n_ports, sizeof(PortRecords));
+    for (size_t i = 0; i < n; i++) if (recs[i].port < n_ports) p[recs[i].port].n++;
+    for (uint32_t k = 0; k < n_ports; k++) {
+        p[k].recs = malloc((p[k].n + 1) * sizeof(TraceRecord *));
+        p[k].n = 0;
+    }
+    for (size_t i = 0; i < n; i++) if (recs[i].port < n_ports) p[recs[i].port].recs[p[recs[i].port].n++] = &recs[i];
+    return p;
+}
+
+static inline int same_frame(const TraceRecord *a, const TraceRecord *b) {
+    return a->decimas == b->decimas && a->status % 3 == b->status % 3;
+}
+
+// Alinea lo recibido (--validar -r) con lo enviado (-r del emisor), puerto a
+// puerto en el mismo orden: latencia de punta a punta (inicio de la escritura
+// a llegada, mismo CLOCK_MONOTONIC, así que ambos en la misma máquina),
+// tramas perdidas en el medio, dañadas y recibidas sin equivalente.
+int compare_traces(const char *arg) {
+    char sent_path[4096];
+    snprintf(sent_path, sizeof(sent_path), "%s", arg);
+    char *comma = strrchr(sent_path, ',');
+    if (!comma) {
+        fprintf(stderr, "Error: --comparar enviada.bin,recibida.bin\n");
+        return 1;
+    }
+    *comma = '\0';
+    const char *recv_path = comma + 1;
+
+    size_t n_sent, n_recv;
+    uint32_t sent_ports, recv_ports;
+    const TraceRecord *sent = trace_map(sent_path, &n_sent, &sent_ports);
+    const TraceRecord *recv = trace_map(recv_path, &n_recv, &recv_ports);
+    PortRecords *sp = trace_split(sent, n_sent, sent_ports);
+    PortRecords *rp = trace_split(recv, n_recv, recv_ports);
+    uint32_t n_ports = sent_ports < recv_ports ? sent_ports : recv_ports;
+
+    unsigned long t_matched = 0, t_lost = 0, t_corrupt = 0, t_unexpected = 0, t_negative = 0;
+    long long t_min = 0;
+    static Hist all;
+    for (uint32_t k = 0; k < n_ports; k++) {
+        const TraceRecord **s = sp[k].recs, **r = rp[k].recs;
+        size_t ns = sp[k].n, nr = rp[k].n, i = 0, j = 0;
+        unsigned long matched = 0, lost = 0, corrupt = 0, unexpected = 0, before = 0, injected = 0, negative = 0;
+        long long min = 0;         // latencia negativa más grande
+        int aligned = 0;
+        for (size_t q = 0; q < ns; q++) injected += (s[q]->flags & TRACE_FAULT) != 0;
+        static Hist latency;
+        memset(&latency, 0, sizeof(latency));
+        for (; j < nr && i < ns; j++) {
+            if (r[j]->flags & TRACE_CORRUPT) {
+                // Una trama dañada ocupa el lugar de la siguiente enviada
+                if (aligned) { corrupt++; i++; }
+                continue;
+            }
+            if (!aligned) {
+                // El validador pudo arrancar después: la primera trama es la
+                // última enviada antes de recibirla con el mismo valor
+                size_t found = ns;
+                for (size_t q = i; q < ns && s[q]->t_ns <= r[j]->t_ns; q++)
+                    if (same_frame(s[q], r[j])) found = q;
+                if (found == ns) { unexpected++; continue; }
+                before = found;
+                i = found;
+                aligned = 1;
+            } else if (!same_frame(s[i], r[j])) {
+                size_t q = i + 1, limit = i + COMPARE_WINDOW < ns ? i + COMPARE_WINDOW : ns;
+                while (q < limit && !same_frame(s[q], r[j])) q++;
+                if (q == limit) { unexpected++; continue; }
+                lost += q - i;
+                i = q;
+            }
+            // Negativa = relojes distintos o traza vieja: no entra al histograma,
+            // que la dejaría en cero
+            long long d = r[j]->t_ns - s[i]->t_ns;
+            if (d < 0) {
+                negative++;
+                if (d < min) min = d;
+            } else {
+                hist_record(&latency, d);
+                hist_record(&all, d);
+            }
+            matched++;
+            i++;
+        }
+        unexpected += nr - j;
+        printf("Puerto %u: %zu enviadas, %zu recibidas, %lu coinciden, %lu perdidas, %lu dañadas, %lu inesperadas"
+               " (%lu antes de empezar, %zu después de terminar)\n", k, ns, nr, matched, lost, corrupt, unexpected,
+               before, ns - i);
+        if (injected) printf("  %lu enviadas con fallas inyectadas (--fallas)\n", injected);
+        if (negative) printf("  %lu latencias negativas (hasta %.1fus)\n", negative, min / 1e3);
+        hist_print("latencia", &latency);
+        t_negative += negative;
+        if (min < t_min) t_min = min;
+        t_matched += matched;
+        t_lost += lost;
+        t_corrupt += corrupt;
+        t_unexpected += unexpected;
+    }
+    printf("Total: %lu coinciden, %lu perdidas, %lu dañadas, %lu inesperadas\n", t_matched, t_lost, t_corrupt,
+           t_unexpected);
+    if (t_negative) printf("Latencias negativas: %lu (hasta %.1fus)\n", t_negative, t_min / 1e3);
+    hist_print("latencia", &all);
+    return t_lost || t_corrupt || t_unexpected ? 2 : 0;
+}
+
+// Resultado de las mediciones en el propio proceso
+typedef struct {
+    double snprintf_ns, encode_ns;              // por trama
+    double proto_ns[N_PROTOCOLS];
+    int proto_bytes[N_PROTOCOLS];
+    int golden;                                 // tramas de referencia verificadas
+    double physics_ns;                          // por balanza y paso
+} EncoderBench;
+
+// Compara el codificador de plantilla con format_num() + snprintf: primero
+// verifica que ambos producen los mismos bytes en todo el rango y luego
+// mide tramas por segundo de cada uno sobre la misma secuencia de pesos.
+int bench_encoders(EncoderBench *b) {
+    Frame f;
+    char numbuf[64];
+    char buffer[128];
+    frame_init(&f);
+
+    for (int32_t d = -2000000; d <= 2000000; d++) {
+        int len = frame_encode(&f, d);
+        format_num(d / 10.0, numbuf, cfg.num_width);
+        int ref = snprintf(buffer, sizeof(buffer), "%s%s%s", cfg.prefix, numbuf, cfg.suffix);
+        if (len != ref || memcmp(f.bytes, buffer, len) != 0) {
+            fprintf(stderr, "Diferencia en %d: '%.*s' vs '%s'\n", d, len, f.bytes, buffer);
+            return -1;
+        }
+    }
+
+    // Pesos precalculados con la misma caminata que send_frame()
+    enum { N_PESOS = 4096 };
+    static int32_t pesos[N_PESOS];
+    static int8_t steps[N_PESOS];
+    Rng rng;
+    rng_seed(&rng, seed, 0);
+    rng_fill_steps(&rng, steps, N_PESOS);
+    int32_t d = 0;
+    for (int i = 0; i < N_PESOS; i++) {
+        d += 10 + steps[i];
+        if (abs(d) >= reset_limit_d) d = reset_value_d;
+        pesos[i] = d;
+    }
+
+    volatile int sink = 0;
+    long long t0 = now_ns();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        format_num(pesos[i % N_PESOS] / 10.0, numbuf, cfg.num_width);
+        sink += snprintf(buffer, sizeof(buffer), "%s%s%s", cfg.prefix, numbuf, cfg.suffix);
+    }
+    long long t1 = now_ns();
+    for (int i = 0; i < BENCH_FRAMES; i++) {
+        sink += frame_encode(&f, pesos[i % N_PESOS]);
+        __asm__ volatile("" : : "r"(f.bytes) : "memory");
+    }
+    long long t2 = now_ns();
+    b->snprintf_ns = (double)(t1 - t0) / BENCH_FRAMES;
+    b->encode_ns = (double)(t2 - t1) / BENCH_FRAMES;
+
+    // El validador encuentra la trama al final de la línea aunque el ruido
+    // de adelante traiga comas o algo parecido a una trama
+    static const char *const noisy[] = { "", "x,y", ",,", "ST,", "ST,NT,+  12", "\x02+0 00,1" };
+    static ValidatorPort vp;
+    unsigned long long noise = 0;
+    frame_init(&vframe);
+    for (size_t i = 0; i < sizeof(noisy) / sizeof(noisy[0]); i++) {
+        int len = frame_encode(&f, 1234 + i);
+        int n = snprintf(buffer, sizeof(buffer), "%s%.*s", noisy[i], len, f.bytes);
+        validator_line(&vp, buffer, n, now_ns());
+        noise += strlen(noisy[i]);
+    }
+    if (vp.corrupt || vp.frames != sizeof(noisy) / sizeof(noisy[0]) || vp.garbage != noise) {
+        fprintf(stderr, "Validador: %lu tramas con ruido adelante tomadas como dañadas\n", vp.corrupt);
+        return -1;
+    }
+
+    // Salidas de referencia de cada protocolo, con el prefijo, sufijo y
+    // ancho por defecto
+    static const struct {
+        int proto;
+        int32_t gross, tare;
+        uint8_t status;
+        const char *bytes;
+    } golden[] = {
+        { 0, 1234, 0, STATUS_ST, "ST,NT,+  123.4kg\r\n" },
+        { 0, -5, 0, STATUS_US, "US,NT,-    0.5kg\r\n" },
+        { 0, 5000, 1000, STATUS_ST, "ST,NT,+  400.0kg\r\n" },
+        { 1, 5000, 1000, STATUS_OL, "OL,GS,+  500.0kg\r\nOL,TR,+  100.0kg\r\nOL,NT,+  400.0kg\r\n" },
+        { 1, 12345678, 0, STATUS_ST, "ST,GS,+99999.9kg\r\nST,TR,+    0.0kg\r\nST,NT,+99999.9kg\r\n" },
+        { 2, 1234, 0, STATUS_ST, "\x02+0 001234000000\r," },
+        { 2, 50, 100, STATUS_US, "\x02+; 000050000100\r%" },
+        { 3, 1234, 0, STATUS_ST, "ST,NT,+  123.4kg*10\r\n" },
+        { 3, -5, 0, STATUS_US, "US,NT,-    0.5kg*16\r\n" },
+    };
+    b->golden = 0;
+    if (strcmp(cfg.prefix, "ST,NT,") == 0 && strcmp(cfg.suffix, "kg\r\n") == 0 && cfg.num_width == 7) {
+        for (size_t i = 0; i < sizeof(golden) / sizeof(golden[0]); i++) {
+            const Protocol *p = &protocols[golden[i].proto];
+            p->init(&f);
+            int len = p->encode(&f, golden[i].gross, golden[i].tare, golden[i].status);
+            if (len != (int)strlen(golden[i].bytes) || memcmp(f.bytes, golden[i].bytes, len) != 0) {
+                fprintf(stderr, "Protocolo %s: trama %zu distinta de la referencia\n", p->name, i);
+                return -1;
+            }
+        }
+        b->golden = sizeof(golden) / sizeof(golden[0]);
+    }
+    for (size_t k = 0; k < N_PROTOCOLS; k++) {
+        const Protocol *p = &protocols[k];
+        p->init(&f);
+        t1 = now_ns();
+        for (int i = 0; i < BENCH_FRAMES; i++) {
+            sink += p->encode(&f, pesos[i % N_PESOS], 0, STATUS_ST);
+            __asm__ volatile("" : : "r"(f.bytes) : "memory");
+        }
+        t2 = now_ns();
+        b->proto_ns[k] = (double)(t2 - t1) / BENCH_FRAMES;
+        b->proto_bytes[k] = f.fixed_len;
+    }
+
+    // Modelo físico: un paso para todas las balanzas por iteración
+    if (cfg.period_ns == 0) cfg.period_ns = PHYS_MAX_DT_NS;
+    for (int i = 0; i < MAX_SCALES; i++) scales[i].limit_d = reset_limit_d;
+    physics_init(MAX_SCALES);
+    rng_seed(&rng, seed, MAX_SCALES + 1);
+    t0 = now_ns();
+    for (int i = 0; i < PHYS_BENCH_STEPS; i++) physics_step(&phys, 0, MAX_SCALES, &rng);
+    t1 = now_ns();
+    b->physics_ns = (double)(t1 - t0) / ((long long)PHYS_BENCH_STEPS * MAX_SCALES);
+    return 0;
+}
+
+int run_bench(void) {
+    EncoderBench b;
+    if (bench_encoders(&b) != 0) return 1;
+    printf("Codificador verificado: idéntico a format_num() en ±200000.0kg\n");
+    printf("format_num + snprintf: %.2f Mtramas/s (%.1f ns/trama)\n", 1e3 / b.snprintf_ns, b.snprintf_ns);
+    printf("frame_encode:          %.2f Mtramas/s (%.1f ns/trama)\n", 1e3 / b.encode_ns, b.encode_ns);
+    if (b.golden) printf("Protocolos verificados contra %d tramas de referencia\n", b.golden);
+    for (size_t k = 0; k < N_PROTOCOLS; k++)
+        printf("protocolo %-12s %.2f Mtramas/s (%.1f ns/trama, %d bytes)\n", protocols[k].name,
+               1e3 / b.proto_ns[k], b.proto_ns[k], b.proto_bytes[k]);
+    printf("modelo físico:         %.2f Mbalanzas·paso/s (%.2f ns por balanza, %d balanzas)\n",
+           1e3 / b.physics_ns, b.physics_ns, MAX_SCALES);
+    return 0;
+}
+
+// Un escenario de punta a punta: una copia del simulador con N PTY a una
+// frecuencia dada, y este proceso leyendo todos los esclavos como lo haría
+// el sistema bajo prueba.
+typedef struct {
+    const char *kind;
+    int scales;
+    double hz;
+    double seconds;                 // ventana medida, sin el arranque
+    unsigned long frames;           // tramas leídas en la ventana
+    unsigned long long bytes;
+    double cpu_s;                   // CPU del simulador en la ventana
+    long rss_kb, peak_rss_kb;
+    Hist arrival;                   // |intervalo entre llegadas - periodo|
+    double jitter_p50_us, jitter_p99_us, jitter_max_us;   // peor balanza, según el simulador
+    double syscalls_per_frame;
+} BenchRun;
+
+// CPU de todos los hilos de pid, en segundos. schedstat da ns; /proc/pid/stat
+// sólo ticks de 10ms, demasiado grueso para una ventana de 2s.
+double proc_cpu_s(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    unsigned long long total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char stat_path[sizeof(path) + sizeof(de->d_name) + 16];
+        unsigned long long ns;
+        snprintf(stat_path, sizeof(stat_path), "%s/%s/schedstat", path, de->d_name);
+        FILE *f = fopen(stat_path, "r");
+        if (!f) continue;
+        if (fscanf(f, "%llu", &ns) == 1) total += ns;
+        fclose(f);
+    }
+    closedir(dir);
+    return total / 1e9;
+}
+
+long proc_rss_kb(pid_t pid) {
+    char path[64];
+    long size, resident;
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int ok = fscanf(f, "%ld %ld", &size, &resident) == 2;
+    fclose(f);
+    return ok ? resident * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+}
+
+int bench_scenario(BenchRun *r) {
+    char prefix[64], arg_n[16], arg_hz[32], arg_seed[32], arg_threads[16];
+    snprintf(prefix, sizeof(prefix), "/tmp/balanza-bench-%d-", (int)getpid());
+    snprintf(arg_n, sizeof(arg_n), "%d", r->scales);
+    snprintf(arg_hz, sizeof(arg_hz), "%g", r->hz);
+    snprintf(arg_seed, sizeof(arg_seed), "%llu", (unsigned long long)seed);
+    snprintf(arg_threads, sizeof(arg_threads), "%d", n_shards);
+    long long period = llround(1e9 / r->hz);
+
+    // La salida del simulador queda en memoria para leer sus histogramas
+    int out = memfd_create("balanza-bench", MFD_CLOEXEC);
+    if (out == -1) { perror("memfd_create"); return -1; }
+    pid_t pid = fork();
+    if (pid == -1) { perror("fork"); close(out); return -1; }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(out, STDERR_FILENO);
+        // Sin --hilos el NULL corta la lista y el hijo elige como siempre
+        const char *args[] = { "balanza5", "--pty", arg_n, "-f", arg_hz, "-e", "nada", "-b", BENCH_BAUD,
+                               "--pty-enlace", prefix, "--semilla", arg_seed, "--io", cfg.io_uring ? "uring" : "writev",
+                               pin_shards ? "--hilos" : NULL, arg_threads, NULL };
+        execv("/proc/self/exe", (char **)args);
+        _exit(127);
+    }
+
+    int *fds = calloc(r->scales, sizeof(int));
+    long long *last = calloc(r->scales, sizeof(long long));
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    int opened = 0;
+    long long give_up = now_ns() + BENCH_START_NS;
+    while (opened < r->scales && now_ns() < give_up) {
+        char link[96];
+        snprintf(link, sizeof(link), "%s%d", prefix, opened);
+        int fd = open(link, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) {
+            if (waitpid(pid, NULL, WNOHANG) == pid) break;
+            nanosleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = opened };
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        fds[opened++] = fd;
+    }
+
+    int ok = opened == r->scales;
+    if (ok) {
+        struct epoll_event events[MAX_EVENTS];
+        char buf[4096];
+        long long measure = now_ns() + BENCH_WARMUP_NS, end = measure + BENCH_RUN_NS;
+        int measuring = 0;
+        double cpu0 = 0;
+        for (;;) {
+            long long t = now_ns();
+            if (!measuring && t >= measure) {
+                measuring = 1;
+                cpu0 = proc_cpu_s(pid);
+                // Que los histogramas del simulador tampoco cuenten el arranque
+                kill(pid, SIGUSR2);
+            }
+            if (t >= end) break;
+            long long until = measuring ? end : measure;
+            int n = epoll_wait(ep, events, MAX_EVENTS, (int)((until - t) / 1000000) + 1);
+            long long now = now_ns();
+            for (int e = 0; e < n; e++) {
+                int i = events[e].data.u32;
+                ssize_t len;
+                while ((len = read(fds[i], buf, sizeof(buf))) > 0) {
+                    // Cada '\n' cierra una trama; las que llegan juntas
+                    // cuentan como intervalo 0
+                    for (char *p = buf; (p = memchr(p, '\n', buf + len - p)) != NULL; p++) {
+                        if (measuring) {
+                            r->frames++;
+                            if (last[i]) hist_record(&r->arrival, llabs(now - last[i] - period));
+                        }
+                        last[i] = now;
+                    }
+                    if (measuring) r->bytes += len;
+                }
+            }
+        }
+        r->seconds = BENCH_RUN_NS / 1e9;
+        r->cpu_s = proc_cpu_s(pid) - cpu0;
+        r->rss_kb = proc_rss_kb(pid);
+    }
+    kill(pid, SIGINT);
+    struct rusage ru;
+    wait4(pid, NULL, 0, &ru);
+    r->peak_rss_kb = ru.ru_maxrss;
+    for (int i = 0; i < opened; i++) close(fds[i]);
+    close(ep);
+    free(fds);
+    free(last);
+
+    // Peor balanza según los histogramas que imprime el simulador al salir
+    lseek(out, 0, SEEK_SET);
+    FILE *f = fdopen(out, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    while (f && getline(&line, &cap, f) > 0) {
+        double p50, p99, max, calls;
+        if (sscanf(line, " jitter n=%*u p50=%lfus p99=%lfus p999=%*fus max=%lfus", &p50, &p99, &max) == 3) {
+            if (p50 > r->jitter_p50_us) r->jitter_p50_us = p50;
+            if (p99 > r->jitter_p99_us) r->jitter_p99_us = p99;
+            if (max > r->jitter_max_us) r->jitter_max_us = max;
+        } else if (sscanf(line, "Por trama: %lf llamadas", &calls) == 1) {
+            r->syscalls_per_frame = calls;
+        }
+    }
+    free(line);
+    if (f) fclose(f);
+    else close(out);
+    if (!ok) fprintf(stderr, "Escenario %d balanzas a %g Hz: el simulador no abrió los PTY\n", r->scales, r->hz);
+    return ok ? 0 : -1;
+}
+
+void bench_json_run(FILE *f, const BenchRun *r, int last) {
+    double expected = r->scales * r->hz;
+    double fps = r->seconds > 0 ? r->frames / r->seconds : 0;
+    fprintf(f, "    {\"kind\": \"%s\", \"scales\": %d, \"hz\": %g, \"seconds\": %.3f,\n", r->kind, r->scales, r->hz,
+            r->seconds);
+    fprintf(f, "     \"frames\": %lu, \"frames_per_s\": %.1f, \"expected_frames_per_s\": %.1f, \"delivered\": %.4f,\n",
+            r->frames, fps, expected, expected > 0 ? fps / expected : 0);
+    fprintf(f, "     \"bytes_per_s\": %.0f, \"syscalls_per_frame\": %.2f,\n",
+            r->seconds > 0 ? r->bytes / r->seconds : 0, r->syscalls_per_frame);
+    fprintf(f, "     \"deadline_jitter_us\": {\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n", r->jitter_p50_us,
+            r->jitter_p99_us, r->jitter_max_us);
+    fprintf(f, "     \"arrival_jitter_us\": {\"n\": %llu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n",
+            (unsigned long long)r->arrival.total, hist_percentile(&r->arrival, 0.50) / 1e3,
+            hist_percentile(&r->arrival, 0.99) / 1e3, hist_percentile(&r->arrival, 0.999) / 1e3,
+            r->arrival.max / 1e3);
+    fprintf(f, "     \"cpu_pct\": %.2f, \"cpu_us_per_scale_s\": %.2f, \"cpu_us_per_frame\": %.2f,\n",
+            r->seconds > 0 ? 100.0 * r->cpu_s / r->seconds : 0,
+            r->seconds > 0 ? 1e6 * r->cpu_s / r->seconds / r->scales : 0, r->frames ? 1e6 * r->cpu_s / r->frames : 0);
+    fprintf(f, "     \"rss_kb\": %ld, \"peak_rss_kb\": %ld, \"rss_kb_per_scale\": %.1f}%s\n", r->rss_kb,
+            r->peak_rss_kb, (double)r->rss_kb / r->scales, last ? "" : ",");
+}
+
+// Suite completa para comparar builds: codificadores, tramas/s con 1, 64 y
+// 1024 balanzas, jitter a 10 Hz, 100 Hz y 1 kHz, y CPU/RSS por balanza.
+// El JSON va a path ("-" = salida estándar); el avance, a stderr.
+int run_bench_suite(const char *path) {
+    static const struct { const char *kind; int scales; double hz; } plan[] = {
+        { "throughput", 1, 100 },
+        { "throughput", 64, 100 },
+        { "throughput", 1024, 100 },
+        { "jitter", BENCH_JITTER_SCALES, 10 },
+        { "jitter", BENCH_JITTER_SCALES, 100 },
+        { "jitter", BENCH_JITTER_SCALES, 1000 },
+    };
+    enum { N_RUNS = sizeof(plan) / sizeof(plan[0]) };
+    static BenchRun runs[N_RUNS];
+
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "%s: ", path);
+        perror("No se puede crear el resultado");
+        return 1;
+    }
+    // El lector abre un esclavo por balanza
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    fprintf(stderr, "Codificadores...\n");
+    EncoderBench b;
+    if (bench_encoders(&b) != 0) return 1;
+    int failed = 0;
+    for (int k = 0; k < N_RUNS; k++) {
+        BenchRun *r = &runs[k];
+        r->kind = plan[k].kind;
+        r->scales = plan[k].scales;
+        r->hz = plan[k].hz;
+        fprintf(stderr, "%s: %d balanzas a %g Hz...\n", r->kind, r->scales, r->hz);
+        if (bench_scenario(r) != 0) failed++;
+    }
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    fprintf(f, "{\n  \"schema\": 1,\n  \"seed\": %llu,\n", (unsigned long long)seed);
+    fprintf(f, "  \"config\": {\"io\": \"%s\", \"threads\": %d, \"pinned\": %s, \"cpus\": %ld, \"baud\": %s},\n",
+            cfg.io_uring ? "uring" : "writev", n_shards, pin_shards ? "true" : "false", ncpu, BENCH_BAUD);
+    fprintf(f, "  \"encoder\": {\"snprintf_ns\": %.2f, \"frame_encode_ns\": %.2f, \"speedup\": %.2f, \"golden\": %d,\n",
+            b.snprintf_ns, b.encode_ns, b.snprintf_ns / b.encode_ns, b.golden);
+    fprintf(f, "              \"protocols\": {");
+    for (size_t k = 0; k < N_PROTOCOLS; k++)
+        fprintf(f, "%s\"%s\": {\"ns\": %.2f, \"bytes\": %d}", k ? ", " : "", protocols[k].name, b.proto_ns[k],
+                b.proto_bytes[k]);
+    fprintf(f, "},\n              \"physics_ns_per_scale\": %.3f},\n", b.physics_ns);
+    fprintf(f, "  \"runs\": [\n");
+    for (int k = 0; k < N_RUNS; k++) bench_json_run(f, &runs[k], k == N_RUNS - 1);
+    // RSS que agrega cada balanza, sin el costo fijo del proceso
+    fprintf(f, "  ],\n  \"marginal_rss_kb_per_scale\": %.2f,\n  \"failed_runs\": %d\n}\n",
+            (double)(runs[2].rss_kb - runs[0].rss_kb) / (runs[2].scales - runs[0].scales), failed);
+    if (f != stdout) fclose(f);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_opts[] = {
+        { "dispositivo", required_argument, NULL, 'd' },
+        { "frecuencia",  required_argument, NULL, 'f' },
+        { "periodo-us",  required_argument, NULL, 'u' },
+        { "atraso",      required_argument, NULL, 'a' },
+        { "desborde",    required_argument, NULL, 'o' },
+        { "cola-tty",    required_argument, NULL, 'q' },
+        { "baudios",     required_argument, NULL, 'b' },
+        { "linea",       required_argument, NULL, 'L' },
+        { "flujo",       required_argument, NULL, 'F' },
+        { "capacidad",   required_argument, NULL, 'C' },
+        { "semilla",     required_argument, NULL, 's' },
+        { "eco",         required_argument, NULL, 'e' },
+        { "grabar",      required_argument, NULL, 'r' },
+        { "volcar-traza", required_argument, NULL, 'T' },
+        { "reproducir",  required_argument, NULL, 'p' },
+        { "velocidad",   required_argument, NULL, 'V' },
+        { "pty",         required_argument, NULL, 'P' },
+        { "pty-enlace",  required_argument, NULL, 'l' },
+        { "tcp",         required_argument, NULL, 't' },
+        { "tcp-lento",   required_argument, NULL, 'k' },
+        { "udp",         required_argument, NULL, 'm' },
+        { "shm",         required_argument, NULL, 'M' },
+        { "control",     required_argument, NULL, 'K' },
+        { "metricas",    required_argument, NULL, 'y' },
+        { "estres",      required_argument, NULL, 'S' },
+        { "fallas",      required_argument, NULL, 'I' },
+        { "modelo",      required_argument, NULL, 'G' },
+        { "protocolo",   required_argument, NULL, 'Q' },
+        { "hilos",       required_argument, NULL, 'H' },
+        { "io",          required_argument, NULL, 'U' },
+        { "adelanto",    required_argument, NULL, 'A' },
+        { "bench-json",  required_argument, NULL, 'j' },
+        { "validar",     no_argument,       NULL, 'v' },
+        { "escenario",   required_argument, NULL, 'E' },
+        { "comparar",    required_argument, NULL, 'X' },
+        { "bench",       no_argument,       NULL, 'B' },
+        { 0, 0, 0, 0 }
+    };
+    const char *devices[MAX_SCALES];
+    int n_devices = 0;
+    int bench = 0;
+    const char *bench_json = NULL;
+    const char *compare_path = NULL;
+    int validate = 0;
+    int have_seed = 0;
+    const char *record_path = NULL;
+    const char *dump_path = NULL;
+    const char *replay_path = NULL;
+    int n_pty = 0;
+    const char *pty_link = NULL;
+    replay.speed = 1.0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:f:u:a:o:q:b:s:e:r:p:B", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            if (n_devices == MAX_SCALES) {
+                fprintf(stderr, "Error: máximo %d dispositivos.\n", MAX_SCALES);
+                exit(1);
+            }
+            devices[n_devices++] = optarg;
+            break;
+        case 'f': {
+            double hz = atof(optarg);
+            if (hz <= 0) {
+                fprintf(stderr, "Error: frecuencia debe ser mayor que 0 Hz.\n");
+                exit(1);
+            }
+            cfg.period_ns = llround(1e9 / hz);
+            break;
+        }
+        case 'u':
+            cfg.period_ns = llround(atof(optarg) * 1000.0);
+            break;
+        case 'a':
+            if (strcmp(optarg, "recuperar") == 0) cfg.catch_up = 1;
+            else if (strcmp(optarg, "saltar") == 0) cfg.catch_up = 0;
+            else {
+                fprintf(stderr, "Error: atraso debe ser 'recuperar' o 'saltar'.\n");
+                exit(1);
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "viejas") == 0) cfg.overflow_policy = OVERFLOW_DROP_OLDEST;
+            else if (strcmp(optarg, "nuevas") == 0) cfg.overflow_policy = OVERFLOW_DROP_NEWEST;
+            else if (strcmp(optarg, "detener") == 0) cfg.overflow_policy = OVERFLOW_STALL;
+            else {
+                fprintf(stderr, "Error: desborde debe ser 'viejas', 'nuevas' o 'detener'.\n");
+                exit(1);
+            }
+            break;
+        case 'q':
+            cfg.outq_limit = atoi(optarg);
+            if (cfg.outq_limit < 1) {
+                fprintf(stderr, "Error: la cola del tty debe admitir al menos 1 byte.\n");
+                exit(1);
+            }
+            break;
+        case 'b':
+            cfg.baud = atoi(optarg);
+            if (baud_to_speed(cfg.baud) == 0) {
+                fprintf(stderr, "Error: velocidad no soportada: %s baudios.\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'L':
+            // datos, paridad y bits de parada al estilo 8N1 / 7E1 / 8N2
+            if (strlen(optarg) != 3 || (optarg[0] != '7' && optarg[0] != '8') ||
+                !strchr("NEOneo", optarg[1]) || (optarg[2] != '1' && optarg[2] != '2')) {
+                fprintf(stderr, "Error: línea debe ser como 8N1, 7E1 u 8O2.\n");
+                exit(1);
+            }
+            cfg.data_bits = optarg[0] - '0';
+            cfg.parity = tolower(optarg[1]);
+            cfg.stop_bits = optarg[2] - '0';
+            break;
+        case 'F':
+            if (strcmp(optarg, "ninguno") == 0) cfg.flow = FLOW_NONE;
+            else if (strcmp(optarg, "rtscts") == 0) cfg.flow = FLOW_RTSCTS;
+            else if (strcmp(optarg, "xonxoff") == 0) cfg.flow = FLOW_XONXOFF;
+            else {
+                fprintf(stderr, "Error: flujo debe ser 'ninguno', 'rtscts' o 'xonxoff'.\n");
+                exit(1);
+            }
+            break;
+        case 'C':
+            if (strcmp(optarg, "ajustar") == 0) cfg.cap_to_line = 1;
+            else if (strcmp(optarg, "avisar") == 0) cfg.cap_to_line = 0;
+            else {
+                fprintf(stderr, "Error: capacidad debe ser 'ajustar' o 'avisar'.\n");
+                exit(1);
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            have_seed = 1;
+            break;
+        case 'e':
+            if (strcmp(optarg, "todo") == 0) cfg.echo_mode = ECHO_ALL;
+            else if (strcmp(optarg, "eventos") == 0) cfg.echo_mode = ECHO_EVENTS;
+            else if (strcmp(optarg, "nada") == 0) cfg.echo_mode = ECHO_NONE;
+            else if (atoi(optarg) >= 1) {
+                cfg.echo_mode = ECHO_SAMPLED;
+                cfg.echo_every = atoi(optarg);
+            } else {
+                fprintf(stderr, "Error: eco debe ser 'todo', 'eventos', 'nada' o un número N (una de cada N tramas).\n");
+                exit(1);
+            }
+            break;
+        case 'r':
+            record_path = optarg;
+            break;
+        case 'T':
+            dump_path = optarg;
+            break;
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 'P':
+            n_pty = atoi(optarg);
+            if (n_pty < 1 || n_pty > MAX_SCALES) {
+                fprintf(stderr, "Error: cantidad de PTY entre 1 y %d.\n", MAX_SCALES);
+                exit(1);
+            }
+            break;
+        case 'l':
+            pty_link = optarg;
+            break;
+        case 't':
+            cfg.tcp_port = atoi(optarg);
+            if (cfg.tcp_port < 1 || cfg.tcp_port > 65535) {
+                fprintf(stderr, "Error: puerto TCP inválido.\n");
+                exit(1);
+            }
+            break;
+        case 'k':
+            if (strcmp(optarg, "cortar") == 0) cfg.tcp_skip = 0;
+            else if (strcmp(optarg, "saltar") == 0) cfg.tcp_skip = 1;
+            else {
+                fprintf(stderr, "Error: tcp-lento debe ser 'cortar' o 'saltar'.\n");
+                exit(1);
+            }
+            break;
+        case 'm': {
+            // grupo:puerto, por ejemplo 239.0.0.1:6000
+            char group[64];
+            const char *colon = strrchr(optarg, ':');
+            if (!colon || colon - optarg >= (int)sizeof(group)) {
+                fprintf(stderr, "Error: udp debe ser grupo:puerto.\n");
+                exit(1);
+            }
+            memcpy(group, optarg, colon - optarg);
+            group[colon - optarg] = '\0';
+            cfg.udp_addr.sin_family = AF_INET;
+            cfg.udp_addr.sin_port = htons(atoi(colon + 1));
+            if (inet_pton(AF_INET, group, &cfg.udp_addr.sin_addr) != 1) {
+                fprintf(stderr, "Error: dirección UDP inválida: %s\n", group);
+                exit(1);
+            }
+            cfg.udp_enabled = 1;
+            break;
+        }
+        case 'I': {
+            // tipo=probabilidad,... por trama; a lo sumo una falla por trama
+            char *list = strdup(optarg), *save = NULL;
+            double sum = 0;
+            for (char *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+                char *eq = strchr(item, '=');
+                int k = FAULT_CORRUPT;
+                if (eq) *eq = '\0';
+                while (k < N_FAULTS && strcmp(item, fault_names[k]) != 0) k++;
+                double p = eq ? atof(eq + 1) : -1;
+                if (k == N_FAULTS || p < 0 || p > 1) {
+                    fprintf(stderr, "Error: fallas debe ser tipo=probabilidad,... con tipo corromper, truncar, sin-fin,"
+                                    " ruido, duplicar, reordenar o detener.\n");
+                    exit(1);
+                }
+                cfg.fault_p[k] = p;
+            }
+            free(list);
+            for (int k = FAULT_CORRUPT; k < N_FAULTS; k++) sum += cfg.fault_p[k];
+            if (sum > 1) {
+                fprintf(stderr, "Error: las probabilidades de las fallas suman más de 1.\n");
+                exit(1);
+            }
+            cfg.faults = sum > 0;
+            break;
+        }
+        case 'S':
+            if (strcmp(optarg, "parejo") == 0) stress.pattern = STRESS_EVEN;
+            else if (strcmp(optarg, "azar") == 0) stress.pattern = STRESS_RANDOM;
+            else if (strncmp(optarg, "rafaga:", 7) == 0) {
+                stress.pattern = STRESS_BURST;
+                stress.burst = atoi(optarg + 7);
+                if (stress.burst < 1 || stress.burst > STRESS_MAX_BURST) {
+                    fprintf(stderr, "Error: la ráfaga debe tener entre 1 y %d tramas.\n", STRESS_MAX_BURST);
+                    exit(1);
+                }
+            } else {
+                fprintf(stderr, "Error: estres debe ser 'parejo', 'azar' o 'rafaga:N'.\n");
+                exit(1);
+            }
+            break;
+        case 'y': {
+            // [ip:]puerto; sin ip sólo escucha en 127.0.0.1
+            char host[64] = "127.0.0.1";
+            const char *colon = strrchr(optarg, ':');
+            const char *port = optarg;
+            if (colon) {
+                if (colon - optarg >= (int)sizeof(host)) {
+                    fprintf(stderr, "Error: métricas debe ser [ip:]puerto.\n");
+                    exit(1);
+                }
+                memcpy(host, optarg, colon - optarg);
+                host[colon - optarg] = '\0';
+                port = colon + 1;
+            }
+            int n = atoi(port);
+            cfg.metrics_addr.sin_family = AF_INET;
+            cfg.metrics_addr.sin_port = htons(n);
+            if (n < 1 || n > 65535 || inet_pton(AF_INET, host, &cfg.metrics_addr.sin_addr) != 1) {
+                fprintf(stderr, "Error: dirección de métricas inválida: %s\n", optarg);
+                exit(1);
+            }
+            cfg.metrics_enabled = 1;
+            break;
+        }
+        case 'V':
+            if (strcmp(optarg, "max") == 0) replay.speed = 0;
+            else if ((replay.speed = atof(optarg)) <= 0) {
+                fprintf(stderr, "Error: velocidad debe ser un multiplicador positivo o 'max'.\n");
+                exit(1);
+            }
+            break;
+        case 'G': {
+            size_t k;
+            for (k = 0; k < sizeof(models) / sizeof(models[0]); k++)
+                if (strcmp(optarg, models[k].name) == 0) break;
+            if (k == sizeof(models) / sizeof(models[0])) {
+                fprintf(stderr, "Error: modelo debe ser 'rampa' o 'fisico'.\n");
+                exit(1);
+            }
+            model = &models[k];
+            break;
+        }
+        case 'Q': {
+            size_t k;
+            for (k = 0; k < sizeof(protocols) / sizeof(protocols[0]); k++)
+                if (strcmp(optarg, protocols[k].name) == 0) break;
+            if (k == sizeof(protocols) / sizeof(protocols[0])) {
+                fprintf(stderr, "Error: protocolo debe ser 'nt', 'gtn', 'toledo' o 'suma'.\n");
+                exit(1);
+            }
+            proto = &protocols[k];
+            break;
+        }
+        case 'U':
+            if (strcmp(optarg, "writev") == 0) cfg.io_uring = 0;
+            else if (strcmp(optarg, "uring") == 0) cfg.io_uring = 1;
+            else {
+                fprintf(stderr, "Error: io debe ser 'writev' o 'uring'.\n");
+                exit(1);
+            }
+            break;
+        case 'A':
+            cfg.lookahead = atoi(optarg);
+            if (cfg.lookahead < 0 || cfg.lookahead > OUTQ_SLOTS / 2) {
+                fprintf(stderr, "Error: adelanto debe estar entre 0 y %d tramas.\n", OUTQ_SLOTS / 2);
+                exit(1);
+            }
+            break;
+        case 'H':
+            // 0 = un hilo por núcleo; con --hilos cada uno queda fijo a su núcleo
+            n_shards = atoi(optarg);
+            pin_shards = 1;
+            if (n_shards < 0 || n_shards > MAX_SHARDS) {
+                fprintf(stderr, "Error: hilos debe estar entre 0 y %d.\n", MAX_SHARDS);
+                exit(1);
+            }
+            break;
+        case 'K':
+            cfg.control_path = optarg;
+            break;
+        case 'M':
+            if (optarg[0] != '/' || strchr(optarg + 1, '/')) {
+                fprintf(stderr, "Error: el nombre de memoria compartida debe ser como /balanza.\n");
+                exit(1);
+            }
+            cfg.shm_name = optarg;
+            break;
+        case 'B':
+            bench = 1;
+            break;
+        case 'j':
+            bench_json = optarg;
+            break;
+        case 'v':
+            validate = 1;
+            break;
+        case 'E':
+            scenario_path = optarg;
+            break;
+        case 'X':
+            compare_path = optarg;
+            break;
+        default:
+            printf(cfg.msg_usage, argv[0]);
+            exit(1);
+        }
+    }
+    if (n_devices == 0 && n_pty == 0) devices[n_devices++] = SERIAL_PORT;
+    if (n_devices + n_pty > MAX_SCALES) {
+        fprintf(stderr, "Error: máximo %d balanzas.\n", MAX_SCALES);
+        exit(1);
+    }
+
+    if (!have_seed) seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+
+    reset_limit_d = (int32_t)llround(cfg.reset_limit * 10.0);
+    reset_value_d = (int32_t)llround(cfg.reset_value * 10.0);
+    if (bench) return run_bench();
+    if (bench_json) return run_bench_suite(bench_json);
+    if (dump_path) return dump_trace(dump_path);
+    if (compare_path) return compare_traces(compare_path);
+    if (validate) {
+        if (n_devices == 0) {
+            fprintf(stderr, "Error: --validar necesita los puertos a leer con -d.\n");
+            exit(1);
+        }
+        return run_validator(devices, n_devices, record_path);
+    }
+
+    if (argc - optind == 2) {
+        cfg.update_interval = atoi(argv[optind]);
+        cfg.step_value = atoi(argv[optind + 1]);
+        if (cfg.update_interval < 1 || cfg.update_interval > 10) {
+            fprintf(stderr, "Error: intervalo debe estar entre 1 y 10 segundos.\n");
+            exit(1);
+        }
+        if (cfg.step_value < 1 || cfg.step_value > 10) {
+            fprintf(stderr, "Error: paso debe ser entero entre 1 y 10 kg.\n");
+            exit(1);
+        }
+    } else if (!scenario_path) {
+        printf(cfg.msg_default_values, cfg.update_interval, cfg.step_value);
+        printf(cfg.msg_usage, argv[0]);
+    }
+    if (cfg.period_ns == 0) cfg.period_ns = (long long)cfg.update_interval * 1000000000LL;
+    if (cfg.period_ns < MIN_PERIOD_NS) {
+        fprintf(stderr, "Error: periodo mínimo %lldus.\n", MIN_PERIOD_NS / 1000);
+        exit(1);
+    }
+
+    // Una trama no puede salir más rápido de lo que tarda en el cable:
+    // pedir más sólo apila bytes en el kernel y agrega latencia sin límite.
+    Frame probe;
+    proto->init(&probe);
+    long long wire_ns = wire_time_ns(probe.fixed_len);
+    printf(cfg.msg_wire, cfg.baud, cfg.data_bits, toupper(cfg.parity), cfg.stop_bits,
+           probe.fixed_len, wire_ns / 1e6, 1e9 / wire_ns);
+    if (replay_path && stress.pattern) {
+        fprintf(stderr, "Error: --estres no se combina con -p.\n");
+        exit(1);
+    }
+    if (replay_path) {
+        replay_open(replay_path);
+        // Sin marcas de tiempo (log de texto) se usa el periodo configurado
+        // escalado; a velocidad máxima, lo que aguanta la línea.
+        if (!replay.timed) cfg.period_ns = replay.speed > 0 ? llround(cfg.period_ns / replay.speed) : wire_ns;
+        if (cfg.period_ns < MIN_PERIOD_NS) cfg.period_ns = MIN_PERIOD_NS;
+    }
+    line_ns = wire_ns;
+    if (cfg.period_ns < wire_ns) {
+        if (cfg.cap_to_line) {
+            printf("Aviso: periodo pedido menor que el tiempo en el cable, se ajusta a %.3fms\n", wire_ns / 1e6);
+            cfg.period_ns = wire_ns;
+        } else {
+            printf("Aviso: periodo pedido menor que el tiempo en el cable (%.3fms): la cola crecerá\n", wire_ns / 1e6);
+        }
+    }
+
+    // Cada balanza usa dos descriptores (puerto y timer)
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // Sin holgura de timers: los plazos sub-milisegundo se cumplen a tiempo
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    if (cfg.io_uring) {
+        // Sin io_uring (núcleo viejo, io_uring_disabled, seccomp) se sigue con writev
+        Uring *ring = uring_open(8);
+        if (ring) {
+            uring_close(ring);
+            printf("Escrituras por io_uring: una llamada por vuelta del bucle para todos los puertos\n");
+        } else {
+            printf("io_uring no disponible (%s): se usa writev\n", strerror(errno));
+            cfg.io_uring = 0;
+        }
+    }
+
+    // Sin terminal (servicio, stdin redirigido) se maneja sólo por el
+    // socket de control y señales
+    if (isatty(STDIN_FILENO)) enable_raw_mode();
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) { perror("epoll_create1"); exit(1); }
+    // stdin redirigido a un archivo no admite epoll: se sigue sin teclado
+    epoll_add(STDIN_FILENO, EV_TAG(EV_STDIN, 0));
+    setup_signals();
+    setup_control();
+    setup_metrics();
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1 || epoll_add(wake_fd, EV_TAG(EV_WAKE, 0)) == -1) { perror("eventfd"); exit(1); }
+    if (cfg.udp_enabled) {
+        udp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        unsigned char ttl = 1, loop = 1;
+        setsockopt(udp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(udp_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    }
+
+    // Sin --escenario, uno armado con las opciones de la línea de comandos
+    cli_devices = devices;
+    cli_n_devices = n_devices;
+    cli_n_pty = n_pty;
+    char scenario_err[256];
+    scenario = scenario_load(scenario_path, scenario_err, sizeof(scenario_err));
+    if (!scenario) {
+        fprintf(stderr, "Escenario %s: %s\n", scenario_path, scenario_err);
+        exit(1);
+    }
+    if (scenario->n == 0) {
+        fprintf(stderr, "Escenario %s: ninguna balanza\n", scenario_path);
+        exit(1);
+    }
+
+    int total = scenario->n;
+    int n_pty_open = 0;
+    long long t_start = now_ns();
+    for (int i = 0; i < total; i++) {
+        Scale *s = &scales[n_scales++];
+        s->peer_fd = -1;
+        if (scenario->ports[i]) {
+            s->device = strdup(scenario->ports[i]);
+            s->fd = setup_serial(s->device);
+        } else {
+            s->fd = setup_pty(s, pty_link, n_pty_open);
+            printf("PTY %d: %s%s%s\n", n_pty_open, s->device, s->link ? " -> " : "", s->link ? s->link : "");
+            n_pty_open++;
+        }
+        rng_seed(&s->rng, seed, i);
+        rng_seed(&s->fault_rng, seed, 2 * MAX_SCALES + i);
+        s->step_pos = RNG_BLOCK;
+        scenario_apply(s, scenario, t_start, 0);
+        const ScaleParams *p = &scenario->params[i];
+        s->decimas = (int32_t)llround(p->start_min_d + rng_double(&s->rng) * (p->start_max_d - p->start_min_d));
+        for (int k = 0; k < OUTQ_SLOTS; k++) {
+            protocols[s->proto].init(&s->outq[k]);
+            s->outq[k].proto = s->proto;
+        }
+        if (stress.pattern) s->period_ns *= stress.burst;  // -f es la frecuencia de tramas
+        s->tfd = setup_timer(s, i, total);
+        setup_net(s, i);
+        if (replay.map) {
+            s->replay_port = replay.binary ? i % replay.n_ports : 0;
+            replay.active_scales++;
+            replay_seek(s);
+        }
+    }
+
+    for (size_t k = 0; k < N_MODELS; k++) {
+        int used = 0;
+        for (int i = 0; i < n_scales; i++) used |= scales[i].model == k;
+        if (used && models[k].init) models[k].init(n_scales);
+    }
+
+    // Lo que vale es lo del escenario, que puede cambiar por balanza
+    long long period_min = LLONG_MAX, period_max = 0;
+    int32_t step_min = INT32_MAX, step_max = 0;
+    for (int i = 0; i < scenario->n; i++) {
+        const ScaleParams *p = &scenario->params[i];
+        if (p->period_ns < period_min) period_min = p->period_ns;
+        if (p->period_ns > period_max) period_max = p->period_ns;
+        if (p->step_d < step_min) step_min = p->step_d;
+        if (p->step_d > step_max) step_max = p->step_d;
+    }
+    char period_str[32], period_max_str[32];
+    format_period(period_min, period_str, sizeof(period_str));
+    format_period(period_max, period_max_str, sizeof(period_max_str));
+    if (period_min == period_max && step_min == step_max && step_min % 10 == 0)
+        printf(cfg.msg_sending, period_str, step_min / 10);
+    else
+        printf(cfg.msg_sending_mixed, period_str, period_max_str, step_min / 10.0, step_max / 10.0);
+    if (phys.dt_ns)
+        printf("Modelo físico: plato %.2gHz (amortiguamiento %.2g), vibración ±%.2gkg, estable dentro de %.2gkg\n",
+               cfg.phys_freq, cfg.phys_damping, cfg.phys_noise, cfg.phys_tol);
+    printf("Semilla: %llu (repetir con --semilla %llu)\n", (unsigned long long)seed, (unsigned long long)seed);
+    if (scenario_path)
+        printf("Escenario %s: %d balanzas, %d eventos (kill -HUP %d lo recarga)\n", scenario_path, scenario->n,
+               scenario->n_events, (int)getpid());
+    if (replay.timed) {
+        replay.start_ns = now_ns() + 10000000LL;
+        for (int i = 0; i < n_scales; i++)
+            if (!scales[i].replay_done) arm_oneshot(&scales[i], replay_due_ns(&scales[i]));
+    }
+    if (cfg.shm_name) {
+        shm_setup();
+        for (int i = 0; i < n_scales; i++) shm_update(&scales[i]);
+        printf("Memoria compartida: %s (%d ranuras de %zu bytes)\n", cfg.shm_name, n_scales, sizeof(BalanzaShmSlot));
+    }
+    if (cfg.tcp_port)
+        printf("TCP: balanza i en el puerto %d + i (clientes lentos: %s)\n", cfg.tcp_port, cfg.tcp_skip ? "saltar" : "cortar");
+    if (cfg.udp_enabled)
+        printf("UDP: %s, balanza i en el puerto %d + i\n", inet_ntoa(cfg.udp_addr.sin_addr), ntohs(cfg.udp_addr.sin_port));
+    if (replay.map)
+        printf("Reproduciendo %s (%s, velocidad %s%.4gx)\n", replay_path, replay.binary ? "traza binaria" : "log de texto",
+               replay.speed > 0 ? "" : "máx ", replay.speed > 0 ? replay.speed : 1.0);
+    if (cfg.faults) {
+        Rng rng;
+        rng_seed(&rng, seed, 3 * MAX_SCALES);
+        for (int i = 0; i < FAULT_NOISE; i++) {
+            // Nada que parezca sintaxis de trama: el ruido antes de una
+            // trama tiene que contar como ruido, no como trama dañada. La
+            // última tampoco repite la primera: fault_pick avanza con vuelta
+            uint8_t prev = i ? fault_noise[i - 1] : 0, next = i == FAULT_NOISE - 1 ? fault_noise[0] : prev;
+            do fault_noise[i] = rng_next(&rng);
+            while (memchr("\n\r,", fault_noise[i], 3) || fault_noise[i] == prev || fault_noise[i] == next);
+        }
+        printf("Fallas por trama en la salida serie:");
+        for (int k = FAULT_CORRUPT; k < N_FAULTS; k++)
+            if (cfg.fault_p[k] > 0) printf(" %s %.3g%%", fault_names[k], cfg.fault_p[k] * 100);
+        printf("\n");
+    }
+    if (stress.pattern) {
+        long long now = now_ns();
+        for (int i = 0; i < n_scales; i++) {
+            scales[i].stress = calloc(1, sizeof(StressState));
+            if (!scales[i].stress) { perror("calloc"); exit(1); }
+            rng_seed(&scales[i].stress->rng, seed, 4 * MAX_SCALES + i);
+            stress_begin(&scales[i], now);
+            scales[i].stress->step_end = now + STRESS_WARMUP_NS;
+        }
+        stress.active_scales = n_scales;
+        static const char *const pattern_names[] = { "", "parejo", "en ráfagas", "con huecos al azar" };
+        printf("Estrés %s: de %.1f tramas/s hasta la línea (%.1f tramas/s), x%.2f cada %.0fs o %d tramas\n",
+               pattern_names[stress.pattern], 1e9 / cfg.period_ns, 1e9 / line_ns, STRESS_FACTOR, STRESS_STEP_NS / 1e9,
+               STRESS_STEP_FRAMES);
+    }
+    if (record_path) trace_fd = trace_open(record_path, n_scales);
+    shards_init();
+    if (n_shards > 1 || pin_shards)
+        printf("Hilos: %d, %d-%d balanzas cada uno%s\n", n_shards, n_scales / n_shards,
+               (n_scales + n_shards - 1) / n_shards, pin_shards ? ", fijos a un núcleo" : "");
+    fflush(stdout);
+    log_start();
+    shards_start();
+
+    control_loop();
 
-    cleanup(0);
+    shards_stop();
+    cleanup();
     return 0;
 }
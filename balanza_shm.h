@@ -0,0 +1,127 @@
+// Peso publicado por balanza5 en memoria compartida (--shm /nombre).
+//
+// Un segmento POSIX con una cabecera y una ranura de 64 bytes por balanza.
+// Cada ranura usa un seqlock: el simulador pone seq impar, escribe y vuelve
+// a dejarla par. El lector copia los campos y reintenta si seq cambió, así
+// obtiene un valor consistente sin syscalls ni locks.
+//
+// Uso desde otro programa:
+//     BalanzaShm shm;
+//     if (balanza_shm_open("/balanza", &shm) == 0) {
+//         BalanzaShmValue v;
+//         balanza_shm_read(&shm, 0, &v);
+//         printf("%.1f kg\n", v.decimas / 10.0);
+//     }
+#ifndef BALANZA_SHM_H
+#define BALANZA_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BALANZA_SHM_MAGIC   0x5a4c4142u   // "BALZ"
+#define BALANZA_SHM_VERSION 1
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BALANZA_SHM_RELAX() __builtin_ia32_pause()
+#else
+#define BALANZA_SHM_RELAX() do { } while (0)
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_scales;
+    uint32_t slot_size;
+    char pad[48];
+} BalanzaShmHeader;
+
+typedef struct {
+    uint32_t seq;          // impar mientras el simulador escribe
+    int32_t decimas;       // peso en décimas de kg
+    uint8_t status;        // 0 = ST, 1 = US, 2 = OL
+    uint8_t paused;
+    uint8_t pad[2];
+    uint64_t frames;       // número de secuencia: tramas generadas
+    int64_t t_ns;          // CLOCK_MONOTONIC del valor
+    char device[32];
+} __attribute__((aligned(64))) BalanzaShmSlot;
+
+// Copia consistente de una ranura
+typedef struct {
+    int32_t decimas;
+    uint8_t status;
+    uint8_t paused;
+    uint64_t frames;
+    int64_t t_ns;
+} BalanzaShmValue;
+
+typedef struct {
+    const BalanzaShmHeader *header;
+    const BalanzaShmSlot *slots;
+    size_t size;
+} BalanzaShm;
+
+static inline int balanza_shm_open(const char *name, BalanzaShm *shm) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(BalanzaShmHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    shm->header = (const BalanzaShmHeader *)map;
+    shm->slots = (const BalanzaShmSlot *)((const char *)map + sizeof(BalanzaShmHeader));
+    shm->size = st.st_size;
+    if (shm->header->magic != BALANZA_SHM_MAGIC || shm->header->version != BALANZA_SHM_VERSION ||
+        shm->header->slot_size != sizeof(BalanzaShmSlot) ||
+        sizeof(BalanzaShmHeader) + (size_t)shm->header->n_scales * sizeof(BalanzaShmSlot) > shm->size) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void balanza_shm_close(BalanzaShm *shm) {
+    munmap((void *)shm->header, shm->size);
+}
+
+static inline void balanza_shm_read(const BalanzaShm *shm, uint32_t idx, BalanzaShmValue *out) {
+    const BalanzaShmSlot *s = &shm->slots[idx];
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            BALANZA_SHM_RELAX();
+            continue;
+        }
+        out->decimas = __atomic_load_n(&s->decimas, __ATOMIC_RELAXED);
+        out->status = __atomic_load_n(&s->status, __ATOMIC_RELAXED);
+        out->paused = __atomic_load_n(&s->paused, __ATOMIC_RELAXED);
+        out->frames = __atomic_load_n(&s->frames, __ATOMIC_RELAXED);
+        out->t_ns = __atomic_load_n(&s->t_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) return;
+    }
+}
+
+// Lado del simulador: una sola escritura por ranura a la vez
+static inline void balanza_shm_write(BalanzaShmSlot *s, const BalanzaShmValue *v) {
+    uint32_t seq = s->seq;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&s->decimas, v->decimas, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->status, v->status, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->paused, v->paused, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->frames, v->frames, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->t_ns, v->t_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#endif
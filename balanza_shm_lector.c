@@ -0,0 +1,62 @@
+// Lector de ejemplo del peso que publica balanza5 --shm.
+// Compilar: gcc -O2 -o balanza_shm_lector balanza_shm_lector.c
+//
+//   balanza_shm_lector [/nombre]        muestra el peso de cada balanza
+//   balanza_shm_lector -b [/nombre]     mide cuánto cuesta una lectura
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "balanza_shm.h"
+
+#define BENCH_READS 50000000
+
+static const char status_code[][3] = { "ST", "US", "OL" };
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+    int bench = 0;
+    const char *name = "/balanza";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) bench = 1;
+        else name = argv[i];
+    }
+
+    BalanzaShm shm;
+    if (balanza_shm_open(name, &shm) != 0) {
+        fprintf(stderr, "No se puede abrir %s (¿balanza5 corre con --shm %s?)\n", name, name);
+        return 1;
+    }
+    uint32_t n = shm.header->n_scales;
+
+    if (!bench) {
+        for (uint32_t i = 0; i < n; i++) {
+            BalanzaShmValue v;
+            balanza_shm_read(&shm, i, &v);
+            printf("%-24s %s %+9.1fkg  trama %llu%s\n", shm.slots[i].device, status_code[v.status % 3],
+                   v.decimas / 10.0, (unsigned long long)v.frames, v.paused ? "  (pausada)" : "");
+        }
+        balanza_shm_close(&shm);
+        return 0;
+    }
+
+    // Lecturas seguidas recorriendo todas las balanzas, mientras el
+    // simulador sigue escribiendo
+    BalanzaShmValue v;
+    long long sum = 0;
+    long long t0 = now_ns();
+    for (long i = 0; i < BENCH_READS; i++) {
+        balanza_shm_read(&shm, i % n, &v);
+        sum += v.decimas;
+    }
+    long long t1 = now_ns();
+    printf("%d lecturas en %u balanzas: %.1f ns/lectura (%.1f M lecturas/s) [%lld]\n", BENCH_READS, n,
+           (double)(t1 - t0) / BENCH_READS, BENCH_READS / ((t1 - t0) / 1e3), sum & 1);
+    balanza_shm_close(&shm);
+    return 0;
+}